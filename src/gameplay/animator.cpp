@@ -1,7 +1,6 @@
 #include "animator.h"
 
-#include "../graphics/subtexture.h"
-#include "../platform.h"
+#include "content.h"
 
 namespace ITD {
 
@@ -18,12 +17,11 @@ Animator::Animator(const std::string &sprite_sheet, const Recti &frame_bounds,
     , pivot(pivot)
     , rotation(0.0f)
 {
-    std::string path = Platform::app_path() + "../res/" + sprite_sheet + ".png";
-    Image img(path);
-    m_texture.load(img);
+    // Frame bounds are relative to the sheet's place in the atlas
+    m_sheet = Content::find_sprite(sprite_sheet);
 
-    m_subtexture.set_bounds(m_frame_bounds);
-    m_subtexture.set_texture(&m_texture);
+    m_subtexture.set_bounds(m_frame_bounds + m_sheet.get_bounds().bl);
+    m_subtexture.set_texture(m_sheet.get_texture());
 }
 
 void Animator::update(float elapsed)
@@ -38,8 +36,8 @@ void Animator::update(float elapsed)
         m_frame_timer = 0.0f;
 
         m_subtexture.set_bounds(
-            m_frame_bounds +
-            glm::vec2(m_frame_index * m_frame_bounds.width(), 0.0f));
+            m_frame_bounds + m_sheet.get_bounds().bl +
+            glm::ivec2(m_frame_index * m_frame_bounds.width(), 0));
     }
 }
 
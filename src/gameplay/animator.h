@@ -1,6 +1,6 @@
 #pragma once
 
-#include "../graphics/texture.h"
+#include "../graphics/subtexture.h"
 #include "ecs.h"
 
 namespace ITD {
@@ -15,7 +15,7 @@ public:
 
 private:
     std::string m_sprite_sheet;
-    Texture m_texture;
+    Subtexture m_sheet;
     Recti m_frame_bounds;
     size_t m_nframes;
     size_t m_frame_index;
@@ -7,15 +7,29 @@
 namespace ITD {
 
 Collider::Collider(const Rectf &bounds, float rotation, bool dynamic)
-    : m_bounds(bounds)
-    , m_rotation(rotation)
-    , m_dynamic(dynamic)
-    , mask(Mask::None)
+    : mask(Mask::None)
     , collides_with(Mask::None)
     , active(true)
     , trigger_only(false)
-    , m_in_bucket(false)
+    , m_bounds(bounds)
+    , m_rotation(rotation)
+    , m_dynamic(dynamic)
     , m_invalid_cache(true)
+    , m_axis_aligned(false)
+    , m_cached_rotation(0.0f)
+    , m_rot_cos(1.0f)
+    , m_rot_sin(0.0f)
+    , m_level(0)
+    , m_in_bucket(false)
+    , m_flat_index(no_flat_index)
+    , m_sleeping(false)
+    , m_rest_frames(0)
+    , m_rest_pos(glm::vec2())
+    , m_rest_rotation(rotation)
+    , m_rest_bounds(bounds)
+    , m_island(UINT32_MAX)
+    , m_body_index(UINT32_MAX)
+    , m_solver_body(UINT32_MAX)
 {
 }
 
@@ -55,10 +69,21 @@ void Collider::refresh()
     }
 }
 
+void Collider::invalidate()
+{
+    if (m_invalid_cache)
+        return;
+
+    // Recalculated in bulk at the start of the next collision update, or
+    // earlier if needed
+    m_invalid_cache = true;
+    scene()->collision_handler()->mark_dirty(this);
+}
+
 void Collider::set_bounds(const Rectf &bounds)
 {
     m_bounds = bounds;
-    m_invalid_cache = true;
+    invalidate();
 }
 
 Rectf Collider::get_bounds() const
@@ -69,13 +94,13 @@ Rectf Collider::get_bounds() const
 void Collider::set_rotation(float rotation)
 {
     m_rotation = rotation;
-    m_invalid_cache = true;
+    invalidate();
 }
 
 void Collider::rotate(float amount)
 {
     m_rotation += amount;
-    m_invalid_cache = true;
+    invalidate();
 }
 
 float Collider::get_rotation() const
@@ -86,6 +111,7 @@ float Collider::get_rotation() const
 void Collider::face_towards(const glm::vec2 &dir)
 {
     m_rotation = glm::orientedAngle(glm::vec2(dir.x, -dir.y), Calc::right);
+    invalidate();
 }
 
 void Collider::set_dynamic(bool dynamic)
@@ -110,6 +136,17 @@ bool Collider::is_dynamic() const
     return m_dynamic;
 }
 
+bool Collider::is_sleeping() const
+{
+    return m_sleeping;
+}
+
+bool Collider::is_axis_aligned()
+{
+    refresh();
+    return m_axis_aligned;
+}
+
 Quadf Collider::quad()
 {
     refresh();
@@ -124,11 +161,23 @@ Rectf Collider::bbox()
 
 void Collider::on_position_changed()
 {
-    m_invalid_cache = true;
+    invalidate();
 }
 
 Collider::Projection Collider::project(const glm::vec2 &axis) const
 {
+    if (m_axis_aligned)
+    {
+        // Project the center and the half extents instead of all corners
+        glm::vec2 center = m_bbox.center();
+        glm::vec2 half = (m_bbox.tr - m_bbox.bl) / 2.0f;
+
+        float dot = glm::dot(center, axis);
+        float radius = half.x * std::abs(axis.x) + half.y * std::abs(axis.y);
+
+        return {.start = dot - radius, .end = dot + radius};
+    }
+
     float min = FLT_MAX;
     float max = -FLT_MAX;
 
@@ -142,17 +191,73 @@ Collider::Projection Collider::project(const glm::vec2 &axis) const
     return {.start = min, .end = max};
 }
 
+void Collider::project_pair(const Collider &other, const Collider &owner,
+                            size_t i, Projection *prj, Projection *oprj) const
+{
+    if (owner.m_axis_aligned)
+    {
+        // The axes are the world axes, so the projections are given by the
+        // bounding boxes
+        *prj = {.start = m_bbox.bl[i], .end = m_bbox.tr[i]};
+        *oprj = {.start = other.m_bbox.bl[i], .end = other.m_bbox.tr[i]};
+    }
+    else
+    {
+        *prj = project(owner.m_axes[i]);
+        *oprj = other.project(owner.m_axes[i]);
+    }
+}
+
 bool Collider::overlaps(Collider &other)
 {
     return push_out(other) != glm::vec2();
 }
 
+glm::vec2 Collider::aabb_push_out(const Collider &other) const
+{
+    const Rectf &box = m_bbox;
+    const Rectf &obox = other.m_bbox;
+
+    // No push out if not overlapping
+    if (box.tr.x < obox.bl.x || obox.tr.x < box.bl.x || box.tr.y < obox.bl.y ||
+        obox.tr.y < box.bl.y)
+    {
+        return glm::vec2();
+    }
+
+    // Check if positive or negative direction push is smallest
+    float push1 = obox.tr.x - box.bl.x;
+    float push2 = obox.bl.x - box.tr.x;
+    float push_x = std::abs(push1) < std::abs(push2) ? push1 : push2;
+
+    push1 = obox.tr.y - box.bl.y;
+    push2 = obox.bl.y - box.tr.y;
+    float push_y = std::abs(push1) < std::abs(push2) ? push1 : push2;
+
+    if (std::abs(push_y) < std::abs(push_x))
+    {
+        return glm::vec2(0.0f, push_y);
+    }
+
+    return glm::vec2(push_x, 0.0f);
+}
+
 glm::vec2 Collider::push_out(Collider &other)
 {
     refresh();
     other.refresh();
 
-    const glm::vec2 *all_axes[2] = {m_axes, other.m_axes};
+    return calc_push_out(other);
+}
+
+glm::vec2 Collider::calc_push_out(const Collider &other) const
+{
+    if (m_axis_aligned && other.m_axis_aligned)
+    {
+        return aabb_push_out(other);
+    }
+
+    const Collider *owners[2] = {this, &other};
 
     // No need to check both colliders axes if the rotation is the same
     size_t naxes = 2 - (m_rotation == other.m_rotation);
@@ -162,14 +267,12 @@ glm::vec2 Collider::push_out(Collider &other)
 
     for (size_t i = 0; i < naxes; i++)
     {
-        const glm::vec2 *axes = all_axes[i];
+        const Collider *owner = owners[i];
 
         for (size_t j = 0; j < 2; j++)
         {
-            glm::vec2 axis = axes[j];
-
-            Projection prj1 = project(axis);
-            Projection prj2 = other.project(axis);
+            Projection prj1, prj2;
+            project_pair(other, *owner, j, &prj1, &prj2);
 
             // No push out if not overlapping
             if (std::min(prj1.end, prj2.end) < std::max(prj1.start, prj2.start))
@@ -185,7 +288,7 @@ glm::vec2 Collider::push_out(Collider &other)
             if (std::abs(push) < std::abs(min_push))
             {
                 min_push = push;
-                push_dir = axis;
+                push_dir = owner->m_axes[j];
             }
         }
     }
@@ -198,23 +301,22 @@ float Collider::distance(Collider &other)
     refresh();
     other.refresh();
 
-    const glm::vec2 *all_axes[2] = {m_axes, other.m_axes};
+    const Collider *owners[2] = {this, &other};
 
-    // No need to check both colliders axes if the rotation is the same
-    size_t naxes = 2 - (m_rotation == other.m_rotation);
+    // No need to check both colliders axes if they are parallel
+    size_t naxes = 2 - (m_rotation == other.m_rotation ||
+                        (m_axis_aligned && other.m_axis_aligned));
 
     float max_dist = 0.0f;
 
     for (size_t i = 0; i < naxes; i++)
     {
-        const glm::vec2 *axes = all_axes[i];
+        const Collider *owner = owners[i];
 
         for (size_t j = 0; j < 2; j++)
         {
-            glm::vec2 axis = axes[j];
-
-            Projection prj1 = project(axis);
-            Projection prj2 = other.project(axis);
+            Projection prj1, prj2;
+            project_pair(other, *owner, j, &prj1, &prj2);
 
             float dist =
                 std::max(prj1.start, prj2.start) - std::min(prj1.end, prj2.end);
@@ -237,27 +339,57 @@ void Collider::check_all(uint32_t mask, std::vector<Collider *> *out)
 
 void Collider::recalculate()
 {
-    m_quad = Quadf(m_bounds, m_rotation);
-    m_quad += m_entity->get_pos();
+    m_axis_aligned = std::fmod(m_rotation, Calc::TAU) == 0.0f;
 
-    m_axes[0] = Calc::normalize(m_quad.d - m_quad.a);
-    m_axes[1] = Calc::normalize(m_quad.b - m_quad.a);
+    if (m_axis_aligned)
+    {
+        // No rotation, the bounds are both the quad and the bounding box
+        m_bbox = m_bounds + m_entity->get_pos();
 
-    float min_x = FLT_MAX;
-    float min_y = FLT_MAX;
-    float max_x = -FLT_MAX;
-    float max_y = -FLT_MAX;
+        m_quad.a = m_bbox.bl;
+        m_quad.b = m_bbox.top_left();
+        m_quad.c = m_bbox.tr;
+        m_quad.d = m_bbox.bot_right();
 
-    for (const auto &point : m_quad.values)
-    {
-        min_x = std::min(point.x, min_x);
-        min_y = std::min(point.y, min_y);
-        max_x = std::max(point.x, max_x);
-        max_y = std::max(point.y, max_y);
+        m_axes[0] = Calc::right;
+        m_axes[1] = Calc::up;
+
+        return;
     }
 
-    m_bbox.bl = glm::vec2(min_x, min_y);
-    m_bbox.tr = glm::vec2(max_x, max_y);
+    update_rotation_cache();
+
+    // Rotate the corners around the center of the bounds
+    glm::vec2 center = m_bounds.center() + m_entity->get_pos();
+    glm::vec2 half = (m_bounds.tr - m_bounds.bl) / 2.0f;
+    glm::vec2 right = glm::vec2(m_rot_cos, m_rot_sin);
+    glm::vec2 up = glm::vec2(-m_rot_sin, m_rot_cos);
+
+    m_quad.a = center - right * half.x - up * half.y;
+    m_quad.b = center - right * half.x + up * half.y;
+    m_quad.c = center + right * half.x + up * half.y;
+    m_quad.d = center + right * half.x - up * half.y;
+
+    m_axes[0] = right;
+    m_axes[1] = up;
+
+    glm::vec2 extent =
+        glm::vec2(std::abs(m_rot_cos) * half.x + std::abs(m_rot_sin) * half.y,
+                  std::abs(m_rot_sin) * half.x + std::abs(m_rot_cos) * half.y);
+
+    m_bbox.bl = center - extent;
+    m_bbox.tr = center + extent;
+}
+
+void Collider::update_rotation_cache()
+{
+    // Moving without rotating is the common case
+    if (m_rotation != m_cached_rotation)
+    {
+        m_cached_rotation = m_rotation;
+        m_rot_cos = std::cos(m_rotation);
+        m_rot_sin = std::sin(m_rotation);
+    }
 }
 
 void Collider::render_outline(Renderer *renderer, Color color)
@@ -18,32 +18,71 @@ class Collider : public Component
     friend class Entity;
 
 private:
+    static constexpr uint32_t no_flat_index = UINT32_MAX;
+
     struct Projection {
         float start;
         float end;
     };
 
+    // Grid cell the collider is in, slot is its position in the bucket
+    struct CellRef {
+        uint32_t bucket;
+        uint32_t slot;
+        glm::ivec2 cell;
+    };
+
 public:
     uint32_t mask;
     uint32_t collides_with;
     bool active;
     bool trigger_only;
+
+    // Called every frame the colliders overlap
     std::function<bool(Collider *collider, Collider *other,
                        const glm::vec2 &dir)>
         on_collide;
 
+    // Called once when the colliders start and stop overlapping
+    std::function<void(Collider *collider, Collider *other,
+                       const glm::vec2 &dir)>
+        on_contact_enter;
+    std::function<void(Collider *collider, Collider *other)> on_contact_exit;
+
 private:
     Rectf m_bounds;
     float m_rotation;
     bool m_dynamic;
     bool m_invalid_cache;
+    bool m_axis_aligned;
+
+    // Rotation the cosine and sine were last computed for
+    float m_cached_rotation;
+    float m_rot_cos;
+    float m_rot_sin;
 
     Quadf m_quad;
     glm::vec2 m_axes[2];
     Rectf m_bbox;
 
+    uint8_t m_level;
     Recti m_bucket_box;
     bool m_in_bucket;
+    std::vector<CellRef> m_cells;
+    uint32_t m_flat_index;
+
+    // Colliders this one has a contact with, so that its contacts can be
+    // removed without going through all of them
+    std::vector<Collider *> m_contacts;
+
+    bool m_sleeping;
+    uint32_t m_rest_frames;
+    glm::vec2 m_rest_pos;
+    float m_rest_rotation;
+    Rectf m_rest_bounds;
+    uint32_t m_island;
+    uint32_t m_body_index;
+    uint32_t m_solver_body;
     std::list<Collider *>::iterator m_dyn_iter;
 
 public:
@@ -62,6 +101,9 @@ public:
     void set_dynamic(bool dynamic);
     bool is_dynamic() const;
 
+    bool is_axis_aligned();
+    bool is_sleeping() const;
+
     Quadf quad();
     Rectf bbox();
 
@@ -82,8 +124,20 @@ private:
     // Assumes that the collider is refreshed
     Projection project(const glm::vec2 &axis) const;
 
+    // Projects both colliders on axis i of owner, which is one of them.
+    // Assumes that the colliders are refreshed
+    void project_pair(const Collider &other, const Collider &owner, size_t i,
+                      Projection *prj, Projection *oprj) const;
+
+    glm::vec2 aabb_push_out(const Collider &other) const;
+
+    // Assumes that the colliders are refreshed
+    glm::vec2 calc_push_out(const Collider &other) const;
+
     void on_position_changed();
+    void invalidate();
     void refresh();
+    void update_rotation_cache();
     void recalculate();
 };
 
@@ -1,4 +1,6 @@
 #include "collisionhandler.h"
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include "../maths/calc.h"
 #include "../platform.h"
@@ -9,21 +11,172 @@
 
 namespace ITD {
 
+bool CollisionHandler::ContactKey::operator==(const ContactKey &other) const
+{
+    return a == other.a && b == other.b;
+}
+
+size_t CollisionHandler::ContactKeyHash::operator()(const ContactKey &key) const
+{
+    return Calc::hash_combine(std::hash<Collider *>()(key.a),
+                              std::hash<Collider *>()(key.b));
+}
+
 CollisionHandler::CollisionHandler()
     : m_scene(nullptr)
+    , m_grid_mode(GridMode::Incremental)
+    , m_cell_size(default_cell_size)
+    , m_auto_tune(false)
+    , m_cell_count(0)
+    , m_frame(0)
+    , m_stats({})
+    , m_rebucket_ops(0)
+    , m_solver_iterations(default_solver_iterations)
 {
 }
 
-void CollisionHandler::init(Scene *scene)
+void CollisionHandler::init(Scene *scene, float cell_size)
 {
     ITD_ASSERT(!m_scene, "Can't initialize collision handler multiple times");
     m_scene = scene;
 
+    // The cell size is tuned when the first colliders have been added
+    m_auto_tune = cell_size <= 0.0f;
+    set_cell_size(m_auto_tune ? default_cell_size : cell_size);
+}
+
+void CollisionHandler::set_grid_mode(uint8_t mode)
+{
+    if (mode == m_grid_mode)
+        return;
+
+    m_grid_mode = mode;
+    reset_grid();
+}
+
+void CollisionHandler::set_cell_size(float size)
+{
+    ITD_ASSERT(size > 0.0f, "Cell size must be greater than 0");
+
+    m_cell_size = size;
+
+    // Every level doubles the cell size of the previous one, until a single
+    // cell covers the whole map
     const Tilemap *map = m_scene->map();
-    m_grid_width = std::ceil(map->width() / 2.0f);
-    m_grid_height = std::ceil(map->height() / 2.0f);
+    m_levels.clear();
+    m_cell_count = 0;
+
+    float level_size = size;
+    while (m_levels.size() < max_grid_levels)
+    {
+        GridLevel level;
+        level.cell_size = level_size;
+        level.inv_cell_size = 1.0f / level_size;
+        level.width = std::ceil(map->pixel_width() * level.inv_cell_size);
+        level.height = std::ceil(map->pixel_height() * level.inv_cell_size);
+        level.offset = m_cell_count;
+
+        m_levels.push_back(level);
+        m_cell_count += level.width * level.height;
+
+        if (level.width <= 1 && level.height <= 1)
+            break;
+
+        level_size *= 2.0f;
+    }
+
+    reset_grid();
+}
+
+float CollisionHandler::cell_size() const
+{
+    return m_cell_size;
+}
+
+void CollisionHandler::set_auto_tune(bool auto_tune)
+{
+    m_auto_tune = auto_tune;
+}
+
+void CollisionHandler::reset_grid()
+{
+    // Drop the current storage and insert all colliders again
+    size_t nbuckets = m_grid_mode == GridMode::Incremental ? m_cell_count : 0;
+    std::vector<std::vector<BucketEntry>>(nbuckets).swap(m_buckets);
+    std::vector<SparseSlot>(sparse_min_capacity, {.key = empty_sparse_key})
+        .swap(m_sparse_slots);
+    m_sparse_keys.clear();
+    m_flat_colliders.clear();
+    m_flat_entries.clear();
+    m_flat_cell_start.assign(m_cell_count + 1, 0);
+
+    for (auto cnode = m_scene->first<Collider>();
+         cnode != m_scene->end<Collider>(); cnode++)
+    {
+        Collider *col = (Collider *)*cnode;
+        col->m_in_bucket = false;
+        col->m_cells.clear();
+        col->m_flat_index = Collider::no_flat_index;
+
+        if (m_grid_mode != GridMode::Rebuild)
+        {
+            update_buckets(col);
+        }
+    }
+
+    if (m_grid_mode == GridMode::Rebuild)
+    {
+        rebuild_flat_grid();
+    }
+}
+
+void CollisionHandler::tune_cell_size()
+{
+    std::vector<float> extents;
+    for (auto cnode = m_scene->first<Collider>();
+         cnode != m_scene->end<Collider>(); cnode++)
+    {
+        Collider *col = (Collider *)*cnode;
+        if (col->alive() && col->active)
+        {
+            glm::vec2 size = col->bbox().tr - col->bbox().bl;
+            extents.push_back(std::max(size.x, size.y));
+        }
+    }
+
+    if (extents.empty())
+        return;
+
+    auto median = extents.begin() + extents.size() / 2;
+    std::nth_element(extents.begin(), median, extents.end());
+
+    // Fit a typical collider in a single cell, rounded to a power of two so
+    // that small changes in the distribution don't rebuild the grid
+    float size = min_cell_size;
+    while (size < *median * 2.0f && size < max_cell_size)
+    {
+        size *= 2.0f;
+    }
+
+    if (size != m_cell_size)
+    {
+        set_cell_size(size);
+    }
+}
+
+void CollisionHandler::set_solver_iterations(size_t iterations)
+{
+    m_solver_iterations = iterations;
+}
 
-    m_buckets.resize(m_grid_width * m_grid_height);
+size_t CollisionHandler::solver_iterations() const
+{
+    return m_solver_iterations;
+}
+
+uint8_t CollisionHandler::grid_mode() const
+{
+    return m_grid_mode;
 }
 
 void CollisionHandler::register_dynamic(Collider *collider)
@@ -34,32 +187,73 @@ void CollisionHandler::register_dynamic(Collider *collider)
 
 void CollisionHandler::deregister_dynamic(Collider *collider)
 {
+    wake(collider);
+
     m_dynamic_colliders.erase(collider->m_dyn_iter);
     collider->m_dyn_iter = m_dynamic_colliders.end();
 }
 
+void CollisionHandler::mark_dirty(Collider *collider)
+{
+    m_dirty.push_back(collider);
+}
+
+void CollisionHandler::refresh_dirty()
+{
+    // Trig first, so that the recalculation loop doesn't wait on it
+    for (auto col : m_dirty)
+    {
+        col->update_rotation_cache();
+    }
+
+    // Colliders that have been refreshed early are skipped
+    for (auto col : m_dirty)
+    {
+        col->refresh();
+    }
+
+    m_dirty.clear();
+}
+
 void CollisionHandler::update_buckets(Collider *collider)
 {
     Rectf bbox = collider->bbox();
-    Recti buc_box = bucket_box(bbox);
+    uint8_t level = grid_level(bbox);
+    Recti buc_box = bucket_box(bbox, level);
 
-    const Recti &prev_buc_box = collider->m_bucket_box;
+    // Sleeping bodies are never tested against static colliders, so they
+    // are woken up if one moves into them
+    if (!collider->m_dynamic)
+    {
+        m_moved_static.push_back(collider);
+    }
 
-    // Remove from previous buckets
-    if (collider->m_in_bucket)
+    // The flat grid is rebuilt from scratch every update
+    if (m_grid_mode == GridMode::Rebuild)
     {
-        const glm::ivec2 &prev_bl = prev_buc_box.bl;
-        const glm::ivec2 &prev_tr = prev_buc_box.tr;
+        collider->m_level = level;
+        collider->m_bucket_box = buc_box;
+        collider->m_in_bucket = true;
+        return;
+    }
+
+    // Slow movers usually stay in the same cells
+    bool same_level = collider->m_in_bucket && collider->m_level == level;
+    const Recti &prev_buc_box = collider->m_bucket_box;
+    if (same_level && prev_buc_box.bl == buc_box.bl &&
+        prev_buc_box.tr == buc_box.tr)
+    {
+        return;
+    }
 
-        for (int y = prev_bl.y; y <= prev_tr.y; y++)
+    // Remove from the cells that are left, moving to another level means
+    // leaving all of them. Backwards since removal moves the last cell
+    std::vector<Collider::CellRef> &cells = collider->m_cells;
+    for (size_t i = cells.size(); i-- > 0;)
+    {
+        if (!same_level || !buc_box.contains(cells[i].cell))
         {
-            for (int x = prev_bl.x; x <= prev_tr.x; x++)
-            {
-                if (!buc_box.contains(glm::ivec2(x, y)))
-                {
-                    remove_bucket(collider, x, y);
-                }
-            }
+            remove_bucket(collider, i);
         }
     }
 
@@ -71,265 +265,339 @@ void CollisionHandler::update_buckets(Collider *collider)
     {
         for (int x = bl.x; x <= tr.x; x++)
         {
-            if (!collider->m_in_bucket ||
-                !prev_buc_box.contains(glm::ivec2(x, y)))
+            if (!same_level || !prev_buc_box.contains(glm::ivec2(x, y)))
             {
-                add_bucket(collider, x, y);
+                add_bucket(collider, level, x, y);
             }
         }
     }
 
+    collider->m_level = level;
     collider->m_bucket_box = buc_box;
     collider->m_in_bucket = true;
 }
 
-void CollisionHandler::add_bucket(Collider *collider, size_t bx, size_t by)
+void CollisionHandler::add_bucket(Collider *collider, uint8_t level, int bx,
+                                  int by)
 {
-    if (valid_bucket_index(bx, by))
-    {
-        m_buckets[by * m_grid_width + bx].push_back(collider);
-    }
+    m_rebucket_ops++;
+
+    uint32_t index = get_bucket(level, bx, by);
+    if (index == no_bucket)
+        return;
+
+    std::vector<BucketEntry> &bucket = m_buckets[index];
+    std::vector<Collider::CellRef> &cells = collider->m_cells;
+
+    bucket.push_back({.collider = collider, .ref = (uint32_t)cells.size()});
+    cells.push_back({
+        .bucket = index,
+        .slot = (uint32_t)bucket.size() - 1,
+        .cell = glm::ivec2(bx, by),
+    });
 }
 
-void CollisionHandler::remove_bucket(Collider *collider, size_t bx, size_t by)
+void CollisionHandler::remove_bucket(Collider *collider, uint32_t ref)
 {
-    if (!valid_bucket_index(bx, by))
-        return;
+    m_rebucket_ops++;
+
+    std::vector<Collider::CellRef> &cells = collider->m_cells;
+    Collider::CellRef cell = cells[ref];
+    std::vector<BucketEntry> &bucket = m_buckets[cell.bucket];
 
-    std::vector<Collider *> *bucket = &m_buckets[by * m_grid_width + bx];
+    // Replace the entry with the one in the back of the bucket
+    const BucketEntry &back = bucket.back();
+    back.collider->m_cells[back.ref].slot = cell.slot;
+    bucket[cell.slot] = back;
+    bucket.pop_back();
 
-    size_t bsize = bucket->size();
-    if (bsize > 1)
+    // Same for the cell list of the collider
+    if (ref != cells.size() - 1)
     {
-        // Replace collider to be removed with collider in the back
-        for (size_t i = 0; i < bsize - 1; i++)
-        {
-            if ((*bucket)[i] == collider)
-            {
-                Collider *back = bucket->back();
-                (*bucket)[i] = back;
-                break;
-            }
-        }
+        const Collider::CellRef &back_cell = cells.back();
+        m_buckets[back_cell.bucket][back_cell.slot].ref = ref;
+        cells[ref] = back_cell;
     }
 
-    bucket->pop_back();
+    cells.pop_back();
 }
 
 void CollisionHandler::remove(Collider *collider)
 {
-    if (collider->m_in_bucket)
-    {
-        const Recti &prev_buc_box = collider->m_bucket_box;
-        glm::ivec2 prev_bl = prev_buc_box.bl;
-        glm::ivec2 prev_tr = prev_buc_box.tr;
+    remove_contacts(collider);
+
+    m_moved_static.erase(
+        std::remove(m_moved_static.begin(), m_moved_static.end(), collider),
+        m_moved_static.end());
 
-        for (int y = prev_bl.y; y <= prev_tr.y; y++)
+    m_dirty.erase(std::remove(m_dirty.begin(), m_dirty.end(), collider),
+                  m_dirty.end());
+
+    if (m_grid_mode == GridMode::Rebuild)
+    {
+        uint32_t index = collider->m_flat_index;
+        if (index < m_flat_colliders.size() &&
+            m_flat_colliders[index] == collider)
         {
-            for (int x = prev_bl.x; x <= prev_tr.x; x++)
-            {
-                remove_bucket(collider, x, y);
-            }
+            m_flat_colliders[index] = nullptr;
         }
+
+        collider->m_flat_index = Collider::no_flat_index;
+        collider->m_in_bucket = false;
+        return;
     }
+
+    while (!collider->m_cells.empty())
+    {
+        remove_bucket(collider, collider->m_cells.size() - 1);
+    }
+
+    collider->m_in_bucket = false;
 }
 
 void CollisionHandler::update_all_buckets()
 {
     for (auto col : m_dynamic_colliders)
     {
-        if (col->active)
+        if (col->active && !col->m_sleeping)
         {
             update_buckets(col);
         }
     }
 }
 
-Recti CollisionHandler::bucket_box(const Rectf &bbox)
+uint8_t CollisionHandler::grid_level(const Rectf &bbox) const
+{
+    // Pick the first level where the collider fits in a single cell, so that
+    // it never covers more than 2x2 cells
+    glm::vec2 size = bbox.tr - bbox.bl;
+    float extent = std::max(size.x, size.y);
+
+    uint8_t level = 0;
+    while (level + 1 < m_levels.size() && extent > m_levels[level].cell_size)
+    {
+        level++;
+    }
+
+    return level;
+}
+
+Recti CollisionHandler::bucket_box(const Rectf &bbox, uint8_t level) const
 {
-    glm::ivec2 bot_index = bucket_index(bbox.bl);
-    glm::ivec2 top_index = bucket_index(bbox.tr);
+    glm::ivec2 bot_index = bucket_index(bbox.bl, level);
+    glm::ivec2 top_index = bucket_index(bbox.tr, level);
 
     return Recti(bot_index, top_index);
 }
 
-glm::ivec2 CollisionHandler::bucket_index(const glm::vec2 &pos)
+glm::ivec2 CollisionHandler::bucket_index(const glm::vec2 &pos,
+                                          uint8_t level) const
 {
-    return glm::ivec2(((int)pos.x) >> 4, ((int)pos.y) >> 4);
+    float inv_cell_size = m_levels[level].inv_cell_size;
+
+    return glm::ivec2(std::floor(pos.x * inv_cell_size),
+                      std::floor(pos.y * inv_cell_size));
 }
 
-bool CollisionHandler::valid_bucket_index(const size_t bx, const size_t by)
+bool CollisionHandler::valid_bucket_index(uint8_t level, int bx, int by) const
 {
-    return bx >= 0 && bx < m_grid_width && by >= 0 && by < m_grid_height;
+    const GridLevel &grid = m_levels[level];
+    return bx >= 0 && bx < (int)grid.width && by >= 0 &&
+           by < (int)grid.height;
 }
 
-void CollisionHandler::update()
+size_t CollisionHandler::cell_index(uint8_t level, int bx, int by) const
 {
-    update_all_buckets();
+    const GridLevel &grid = m_levels[level];
+    return grid.offset + by * grid.width + bx;
+}
 
-    for (size_t i = 0; i < collision_iterations; i++)
+uint32_t CollisionHandler::find_bucket(uint8_t level, int bx, int by) const
+{
+    if (m_grid_mode != GridMode::Sparse)
     {
-        for (auto col : m_dynamic_colliders)
-        {
-            if (col->alive() && col->active)
-            {
-                const Recti &buc_box = col->m_bucket_box;
-                const glm::ivec2 &bl = buc_box.bl;
-                const glm::ivec2 &tr = buc_box.tr;
+        return valid_bucket_index(level, bx, by) ? cell_index(level, bx, by)
+                                                 : no_bucket;
+    }
 
-                for (int y = bl.y; y <= tr.y; y++)
-                {
-                    for (int x = bl.x; x <= tr.x; x++)
-                    {
-                        if (!valid_bucket_index(x, y))
-                            continue;
+    uint64_t key = sparse_key(level, bx, by);
+    size_t mask = m_sparse_slots.size() - 1;
 
-                        const std::vector<Collider *> &bucket =
-                            m_buckets[y * m_grid_width + x];
+    // Linear probing until the key or an empty slot is found
+    for (size_t i = sparse_hash(key) & mask;; i = (i + 1) & mask)
+    {
+        const SparseSlot &slot = m_sparse_slots[i];
+        if (slot.key == key)
+        {
+            return slot.bucket;
+        }
 
-                        for (Collider *ocol : bucket)
-                        {
-                            if (ocol->alive() && ocol->active && col != ocol &&
-                                ((col->collides_with & ocol->mask) ||
-                                 (ocol->collides_with & col->mask)))
-                            {
-                                glm::vec2 push = col->push_out(*ocol);
-                                if (push != glm::vec2())
-                                {
-                                    glm::vec2 push_norm = Calc::normalize(push);
-
-                                    if (ocol->is_dynamic())
-                                    {
-                                        if (!(col->trigger_only ||
-                                              ocol->trigger_only))
-                                        {
-                                            col->entity()->translate(push /
-                                                                     2.0f);
-                                            ocol->entity()->translate(-push /
-                                                                      2.0f);
-
-                                            Mover *mov = col->get<Mover>();
-                                            Mover *omov = ocol->get<Mover>();
-                                            if (mov && omov)
-                                            {
-                                                glm::vec2 vel_diff =
-                                                    mov->vel - omov->vel;
-                                                float p = glm::dot(push_norm,
-                                                                   vel_diff);
-
-                                                if (p < 0.0f)
-                                                {
-                                                    mov->vel -=
-                                                        push_norm * p *
-                                                        collision_elasticity;
-                                                    omov->vel +=
-                                                        push_norm * p *
-                                                        collision_elasticity;
-                                                }
-                                            }
-                                        }
-                                    }
-                                    else
-                                    {
-                                        if (!(col->trigger_only ||
-                                              ocol->trigger_only))
-                                        {
-                                            col->entity()->translate(push);
-
-                                            Mover *mov = col->get<Mover>();
-                                            if (mov)
-                                            {
-                                                float p = glm::dot(push_norm,
-                                                                   mov->vel);
-
-                                                if (p < 0.0f)
-                                                {
-                                                    mov->vel -= push_norm * p;
-                                                }
-                                            }
-                                        }
-                                    }
-
-                                    if ((col->collides_with & ocol->mask) &&
-                                        col->on_collide)
-                                    {
-                                        col->on_collide(col, ocol, push_norm);
-                                    }
-
-                                    if ((ocol->collides_with & col->mask) &&
-                                        ocol->on_collide)
-                                    {
-                                        ocol->on_collide(ocol, col, -push_norm);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        if (slot.key == empty_sparse_key)
+        {
+            return no_bucket;
         }
     }
 }
 
-Collider *CollisionHandler::check(Collider *collider, uint32_t mask)
+uint32_t CollisionHandler::get_bucket(uint8_t level, int bx, int by)
 {
-    if (!collider->m_in_bucket)
-        return nullptr;
+    if (m_grid_mode != GridMode::Sparse)
+    {
+        return find_bucket(level, bx, by);
+    }
 
-    const Recti &buc_box = collider->m_bucket_box;
-    glm::ivec2 bl = buc_box.bl;
-    glm::ivec2 tr = buc_box.tr;
+    // Keep the load factor at or below one half
+    if ((m_buckets.size() + 1) * 2 > m_sparse_slots.size())
+    {
+        rebuild_sparse_table(m_sparse_slots.size() * 2);
+    }
 
-    for (int y = bl.y; y <= tr.y; y++)
+    uint64_t key = sparse_key(level, bx, by);
+    size_t mask = m_sparse_slots.size() - 1;
+
+    for (size_t i = sparse_hash(key) & mask;; i = (i + 1) & mask)
     {
-        for (int x = bl.x; x <= tr.x; x++)
+        SparseSlot &slot = m_sparse_slots[i];
+        if (slot.key == key)
         {
-            if (!valid_bucket_index(x, y))
-                continue;
+            return slot.bucket;
+        }
+
+        if (slot.key == empty_sparse_key)
+        {
+            slot.key = key;
+            slot.bucket = m_buckets.size();
+            m_buckets.emplace_back();
+            m_sparse_keys.push_back(key);
+
+            return slot.bucket;
+        }
+    }
+}
+
+void CollisionHandler::rebuild_sparse_table(size_t capacity)
+{
+    std::vector<SparseSlot>(capacity, {.key = empty_sparse_key})
+        .swap(m_sparse_slots);
+
+    size_t mask = capacity - 1;
+    for (uint32_t b = 0; b < m_buckets.size(); b++)
+    {
+        uint64_t key = m_sparse_keys[b];
+        size_t i = sparse_hash(key) & mask;
+
+        while (m_sparse_slots[i].key != empty_sparse_key)
+        {
+            i = (i + 1) & mask;
+        }
+
+        m_sparse_slots[i] = {.key = key, .bucket = b};
+    }
+}
+
+void CollisionHandler::compact_sparse_grid()
+{
+    size_t nempty = 0;
+    for (const auto &bucket : m_buckets)
+    {
+        nempty += bucket.empty();
+    }
 
-            std::vector<Collider *> &bucket = m_buckets[y * m_grid_width + x];
-            for (Collider *other : bucket)
+    // Cells are never removed from the table as colliders leave them, so
+    // empty cells are dropped in bulk once they make up half of the table
+    if (nempty * 2 <= m_buckets.size())
+        return;
+
+    size_t kept = 0;
+    for (size_t b = 0; b < m_buckets.size(); b++)
+    {
+        if (!m_buckets[b].empty())
+        {
+            // Point the colliders at the new bucket index
+            for (const auto &entry : m_buckets[b])
             {
-                if (collider != other && (mask & other->mask))
-                {
-                    if (collider->overlaps(*other))
-                    {
-                        return other;
-                    }
-                }
+                entry.collider->m_cells[entry.ref].bucket = kept;
             }
+
+            m_buckets[kept].swap(m_buckets[b]);
+            m_sparse_keys[kept] = m_sparse_keys[b];
+            kept++;
         }
     }
 
-    return nullptr;
+    m_buckets.resize(kept);
+    m_sparse_keys.resize(kept);
+
+    size_t capacity = sparse_min_capacity;
+    while (kept * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+
+    rebuild_sparse_table(capacity);
 }
 
-void CollisionHandler::check_all(Collider *collider, uint32_t mask,
-                                 std::vector<Collider *> *out)
+uint64_t CollisionHandler::sparse_key(uint8_t level, int bx, int by)
 {
-    if (!collider->m_in_bucket)
-        return;
+    // 28 bits per coordinate, which is more than enough for any map
+    return ((uint64_t)level << 56) | (((uint64_t)bx & 0xFFFFFFF) << 28) |
+           ((uint64_t)by & 0xFFFFFFF);
+}
 
-    const Recti &buc_box = collider->m_bucket_box;
-    glm::ivec2 bl = buc_box.bl;
-    glm::ivec2 tr = buc_box.tr;
+size_t CollisionHandler::sparse_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
 
-    for (int y = bl.y; y <= tr.y; y++)
+    return key;
+}
+
+template <class F>
+void CollisionHandler::for_each_in_buckets(const Rectf &bbox, F fn)
+{
+    for (uint8_t level = 0; level < m_levels.size(); level++)
     {
-        for (int x = bl.x; x <= tr.x; x++)
-        {
-            if (!valid_bucket_index(x, y))
-                continue;
+        Recti buc_box = bucket_box(bbox, level);
+        const glm::ivec2 &bl = buc_box.bl;
+        const glm::ivec2 &tr = buc_box.tr;
 
-            const std::vector<Collider *> &bucket =
-                m_buckets[y * m_grid_width + x];
-            for (Collider *other : bucket)
+        for (int y = bl.y; y <= tr.y; y++)
+        {
+            for (int x = bl.x; x <= tr.x; x++)
             {
-                if (collider != other && (mask & other->mask))
+                if (m_grid_mode == GridMode::Rebuild)
+                {
+                    if (!valid_bucket_index(level, x, y))
+                        continue;
+
+                    size_t cell = cell_index(level, x, y);
+
+                    for (uint32_t i = m_flat_cell_start[cell];
+                         i < m_flat_cell_start[cell + 1]; i++)
+                    {
+                        const FlatEntry &entry = m_flat_entries[i];
+                        Collider *other = m_flat_colliders[entry.index];
+
+                        // Removed since the last rebuild
+                        if (other)
+                        {
+                            fn(other, entry.bbox);
+                        }
+                    }
+                }
+                else
                 {
-                    if (collider->overlaps(*other))
+                    uint32_t index = find_bucket(level, x, y);
+                    if (index == no_bucket)
+                        continue;
+
+                    // Indexing since the bucket array might grow if a
+                    // collider is rebucketed in fn
+                    for (size_t i = 0; i < m_buckets[index].size(); i++)
                     {
-                        out->push_back(other);
+                        Collider *other = m_buckets[index][i].collider;
+                        fn(other, other->m_bbox);
                     }
                 }
             }
@@ -337,24 +605,807 @@ void CollisionHandler::check_all(Collider *collider, uint32_t mask,
     }
 }
 
-void CollisionHandler::render_dynamic_buckets(Renderer *renderer)
+void CollisionHandler::rebuild_flat_grid()
 {
-    for (auto d : m_dynamic_colliders)
+    size_t ncells = m_cell_count;
+
+    m_flat_colliders.clear();
+    m_flat_cell_start.assign(ncells + 1, 0);
+
+    // Count the number of entries in each cell
+    for (auto cnode = m_scene->first<Collider>();
+         cnode != m_scene->end<Collider>(); cnode++)
     {
-        const Recti &buc_box = d->m_bucket_box;
-        const glm::ivec2 &bl = buc_box.bl;
-        const glm::ivec2 &tr = buc_box.tr;
+        Collider *col = (Collider *)*cnode;
+        if (!col->alive() || !col->active)
+        {
+            col->m_flat_index = Collider::no_flat_index;
+            continue;
+        }
+
+        col->m_level = grid_level(col->m_bbox);
+        col->m_bucket_box = bucket_box(col->m_bbox, col->m_level);
+        col->m_in_bucket = true;
+        col->m_flat_index = m_flat_colliders.size();
+        m_flat_colliders.push_back(col);
+
+        const glm::ivec2 &bl = col->m_bucket_box.bl;
+        const glm::ivec2 &tr = col->m_bucket_box.tr;
 
         for (int y = bl.y; y <= tr.y; y++)
         {
             for (int x = bl.x; x <= tr.x; x++)
             {
-                glm::vec2 pos = glm::vec2(x, y) * 16.0f;
-                renderer->rect(pos, pos + glm::vec2(1.0f, 1.0f) * 16.0f,
-                               Color::green);
+                if (valid_bucket_index(col->m_level, x, y))
+                {
+                    m_flat_cell_start[cell_index(col->m_level, x, y) + 1]++;
+                }
             }
         }
     }
+
+    // Turn the counts into cell offsets
+    for (size_t i = 0; i < ncells; i++)
+    {
+        m_flat_cell_start[i + 1] += m_flat_cell_start[i];
+    }
+
+    m_flat_entries.resize(m_flat_cell_start[ncells]);
+    m_flat_cursor.assign(m_flat_cell_start.begin(),
+                         m_flat_cell_start.end() - 1);
+
+    // Scatter the entries into their cells
+    for (uint32_t i = 0; i < m_flat_colliders.size(); i++)
+    {
+        const Collider *col = m_flat_colliders[i];
+        const glm::ivec2 &bl = col->m_bucket_box.bl;
+        const glm::ivec2 &tr = col->m_bucket_box.tr;
+
+        for (int y = bl.y; y <= tr.y; y++)
+        {
+            for (int x = bl.x; x <= tr.x; x++)
+            {
+                if (valid_bucket_index(col->m_level, x, y))
+                {
+                    uint32_t &cursor =
+                        m_flat_cursor[cell_index(col->m_level, x, y)];
+                    m_flat_entries[cursor] = {.index = i, .bbox = col->m_bbox};
+                    cursor++;
+                    m_rebucket_ops++;
+                }
+            }
+        }
+    }
+}
+
+void CollisionHandler::update()
+{
+    m_frame++;
+    m_stats = {};
+
+    // All lookups after this are plain reads
+    refresh_dirty();
+
+    // Before rebucketing, which skips sleeping bodies, so that bodies
+    // woken here are in the right cells for this update
+    wake_disturbed();
+
+    if (m_auto_tune && m_frame % auto_tune_interval == 1)
+    {
+        tune_cell_size();
+    }
+
+    if (m_grid_mode == GridMode::Rebuild)
+    {
+        rebuild_flat_grid();
+    }
+    else
+    {
+        update_all_buckets();
+    }
+
+    if (m_grid_mode == GridMode::Sparse &&
+        m_frame % sparse_compact_interval == 0)
+    {
+        compact_sparse_grid();
+    }
+
+    gather_contacts();
+    solve_contacts();
+    dispatch_collisions();
+
+    remove_stale_contacts();
+    update_sleeping();
+    count_occupancy();
+
+    // Rebucketing done by moves since the last update is counted as well
+    m_stats.rebucket_ops = m_rebucket_ops;
+    m_rebucket_ops = 0;
+}
+
+const CollisionStats &CollisionHandler::stats() const
+{
+    return m_stats;
+}
+
+template <class F>
+void CollisionHandler::for_each_occupied_cell(F fn) const
+{
+    if (m_grid_mode == GridMode::Sparse)
+    {
+        // Buckets are only allocated for cells that have been used
+        for (uint32_t i = 0; i < m_buckets.size(); i++)
+        {
+            if (m_buckets[i].empty())
+                continue;
+
+            uint64_t key = m_sparse_keys[i];
+            uint8_t level = key >> 56;
+            int bx = (int32_t)(((key >> 28) & 0xFFFFFFF) << 4) >> 4;
+            int by = (int32_t)((key & 0xFFFFFFF) << 4) >> 4;
+            fn(level, bx, by, m_buckets[i].size());
+        }
+
+        return;
+    }
+
+    for (uint8_t level = 0; level < m_levels.size(); level++)
+    {
+        const GridLevel &grid = m_levels[level];
+        for (size_t y = 0; y < grid.height; y++)
+        {
+            for (size_t x = 0; x < grid.width; x++)
+            {
+                size_t cell = cell_index(level, x, y);
+                size_t count = m_grid_mode == GridMode::Rebuild
+                                   ? m_flat_cell_start[cell + 1] -
+                                         m_flat_cell_start[cell]
+                                   : m_buckets[cell].size();
+                if (count > 0)
+                {
+                    fn(level, x, y, count);
+                }
+            }
+        }
+    }
+}
+
+void CollisionHandler::count_occupancy()
+{
+    size_t total = 0;
+    for_each_occupied_cell([&](uint8_t level, int bx, int by, size_t count) {
+        m_stats.occupied_cells++;
+        m_stats.max_bucket_occupancy =
+            std::max(m_stats.max_bucket_occupancy, (uint32_t)count);
+        total += count;
+    });
+
+    m_stats.mean_bucket_occupancy =
+        m_stats.occupied_cells > 0
+            ? (float)total / (float)m_stats.occupied_cells
+            : 0.0f;
+}
+
+void CollisionHandler::gather_contacts()
+{
+    m_solver_bodies.clear();
+    m_solver_contacts.clear();
+    m_collisions.clear();
+
+    for (auto col : m_dynamic_colliders)
+    {
+        col->m_solver_body = no_solver_body;
+    }
+
+    for (auto col : m_dynamic_colliders)
+    {
+        if (!col->alive() || !col->active || col->m_sleeping)
+            continue;
+
+        for_each_in_buckets(col->m_bbox, [&](Collider *ocol,
+                                             const Rectf &obbox) {
+            m_stats.broadphase_candidates++;
+
+            if (!ocol->alive() || !ocol->active || col == ocol ||
+                !((col->collides_with & ocol->mask) ||
+                  (ocol->collides_with & col->mask)))
+            {
+                return;
+            }
+
+            if (!col->m_bbox.overlaps(obbox))
+                return;
+
+            // Pairs are found once per shared cell, and pairs of dynamic
+            // colliders from both sides
+            ContactKey key = col < ocol ? ContactKey{col, ocol}
+                                        : ContactKey{ocol, col};
+            auto it = m_contacts.find(key);
+            if (it != m_contacts.end() && it->second.frame == m_frame)
+                return;
+
+            m_stats.sat_tests++;
+            glm::vec2 push = col->calc_push_out(*ocol);
+            if (push == glm::vec2())
+                return;
+
+            m_stats.overlaps++;
+            glm::vec2 push_norm = Calc::normalize(push);
+            Contact *contact = add_contact(col, ocol, push_norm);
+
+            if (!(col->trigger_only || ocol->trigger_only))
+            {
+                if (ocol->is_dynamic())
+                {
+                    wake(ocol);
+                }
+
+                // Start from last frame's impulse if the contact hasn't
+                // turned much
+                glm::vec2 prev_normal = col < ocol ? contact->normal
+                                                   : -contact->normal;
+                float impulse = 0.0f;
+                if (glm::dot(prev_normal, push_norm) >= warm_start_min_dot)
+                {
+                    impulse = contact->impulse * warm_start_factor;
+                }
+
+                m_solver_contacts.push_back({
+                    .a = solver_body(col),
+                    .b = ocol->is_dynamic() ? solver_body(ocol)
+                                            : no_solver_body,
+                    .normal = push_norm,
+                    .depth = glm::length(push),
+                    .impulse = impulse,
+                    .contact = contact,
+                });
+            }
+
+            contact->normal = col < ocol ? push_norm : -push_norm;
+
+            m_collisions.push_back({
+                .a = col,
+                .b = ocol,
+                .normal = push_norm,
+            });
+        });
+    }
+}
+
+void CollisionHandler::dispatch_collisions()
+{
+    // Indexing, a callback could remove colliders and with them contacts,
+    // but not add collisions
+    for (size_t i = 0; i < m_collisions.size(); i++)
+    {
+        Collision c = m_collisions[i];
+
+        // Destroyed by an earlier callback
+        if (!c.a->alive() || !c.b->alive())
+            continue;
+
+        if ((c.a->collides_with & c.b->mask) && c.a->on_collide)
+        {
+            c.a->on_collide(c.a, c.b, c.normal);
+        }
+
+        if ((c.b->collides_with & c.a->mask) && c.b->on_collide)
+        {
+            c.b->on_collide(c.b, c.a, -c.normal);
+        }
+    }
+}
+
+uint32_t CollisionHandler::solver_body(Collider *collider)
+{
+    if (collider->m_solver_body == no_solver_body)
+    {
+        collider->m_solver_body = m_solver_bodies.size();
+        m_solver_bodies.push_back({
+            .collider = collider,
+            .mover = collider->get<Mover>(),
+            .shift = glm::vec2(),
+        });
+    }
+
+    return collider->m_solver_body;
+}
+
+void CollisionHandler::solve_contacts()
+{
+    // Warm start with the impulses found last frame
+    for (auto &c : m_solver_contacts)
+    {
+        Mover *mov = m_solver_bodies[c.a].mover;
+        if (c.b == no_solver_body)
+        {
+            if (mov)
+            {
+                mov->vel += c.normal * c.impulse;
+            }
+        }
+        else
+        {
+            Mover *omov = m_solver_bodies[c.b].mover;
+            if (mov && omov)
+            {
+                mov->vel += c.normal * c.impulse;
+                omov->vel -= c.normal * c.impulse;
+            }
+        }
+    }
+
+    m_stats.resolutions = m_solver_contacts.size();
+
+    // Every iteration keeps 1 - 2e of the closing speed of a pair, so the
+    // elasticity is split over the iterations to keep the closing speed
+    // that a single exchange with collision_elasticity leaves
+    float elasticity =
+        (1.0f - std::pow(1.0f - 2.0f * collision_elasticity,
+                         1.0f / std::max<size_t>(m_solver_iterations, 1))) /
+        2.0f;
+
+    for (size_t i = 0; i < m_solver_iterations; i++)
+    {
+        for (auto &c : m_solver_contacts)
+        {
+            SolverBody &a = m_solver_bodies[c.a];
+
+            if (c.b == no_solver_body)
+            {
+                // Static colliders push the body all the way out and stop
+                // it from moving into them
+                float depth = c.depth - glm::dot(c.normal, a.shift);
+                if (depth > 0.0f)
+                {
+                    a.shift += c.normal * depth;
+                }
+
+                if (a.mover)
+                {
+                    float p = glm::dot(c.normal, a.mover->vel);
+                    float impulse = std::max(c.impulse - p, 0.0f);
+                    a.mover->vel += c.normal * (impulse - c.impulse);
+                    c.impulse = impulse;
+                }
+            }
+            else
+            {
+                // Dynamic bodies share the correction
+                SolverBody &b = m_solver_bodies[c.b];
+                float depth =
+                    c.depth - glm::dot(c.normal, a.shift - b.shift);
+                if (depth > 0.0f)
+                {
+                    a.shift += c.normal * depth / 2.0f;
+                    b.shift -= c.normal * depth / 2.0f;
+                }
+
+                if (a.mover && b.mover)
+                {
+                    float p = glm::dot(c.normal, a.mover->vel - b.mover->vel);
+                    float impulse =
+                        std::max(c.impulse - p * elasticity, 0.0f);
+                    glm::vec2 delta = c.normal * (impulse - c.impulse);
+                    a.mover->vel += delta;
+                    b.mover->vel -= delta;
+                    c.impulse = impulse;
+                }
+            }
+        }
+    }
+
+    for (const auto &c : m_solver_contacts)
+    {
+        c.contact->impulse = c.impulse;
+    }
+
+    for (const auto &body : m_solver_bodies)
+    {
+        if (body.shift != glm::vec2())
+        {
+            body.collider->entity()->translate(body.shift);
+        }
+    }
+}
+
+void CollisionHandler::wake(Collider *collider)
+{
+    if (!collider->m_sleeping)
+        return;
+
+    // The whole island wakes up together
+    std::vector<Collider *> &island = m_islands[collider->m_island];
+    for (auto col : island)
+    {
+        col->m_sleeping = false;
+        col->m_rest_frames = 0;
+        col->m_island = no_island;
+    }
+
+    m_free_islands.push_back(collider->m_island);
+    island.clear();
+}
+
+void CollisionHandler::wake_disturbed()
+{
+    if (m_islands.size() == m_free_islands.size())
+    {
+        m_moved_static.clear();
+        return;
+    }
+
+    // Bodies that have been moved, turned or resized by something else
+    // than the collision handler, e.g. a mover
+    for (auto col : m_dynamic_colliders)
+    {
+        if (!col->m_sleeping)
+            continue;
+
+        bool moved = glm::length2(col->entity()->get_pos() - col->m_rest_pos) >
+                     wake_distance * wake_distance;
+        bool reshaped = col->m_rotation != col->m_rest_rotation ||
+                        col->m_bounds.bl != col->m_rest_bounds.bl ||
+                        col->m_bounds.tr != col->m_rest_bounds.tr;
+
+        if (moved || reshaped)
+        {
+            wake(col);
+        }
+    }
+
+    // Indexing since refreshing a collider might move it again
+    for (size_t i = 0; i < m_moved_static.size(); i++)
+    {
+        Rectf bbox = m_moved_static[i]->bbox();
+        for_each_in_buckets(bbox, [&](Collider *other, const Rectf &obbox) {
+            if (other->m_sleeping && bbox.overlaps(obbox))
+            {
+                wake(other);
+            }
+        });
+    }
+
+    m_moved_static.clear();
+}
+
+uint32_t CollisionHandler::find_island_root(uint32_t body)
+{
+    while (m_island_parent[body] != body)
+    {
+        // Path halving
+        m_island_parent[body] = m_island_parent[m_island_parent[body]];
+        body = m_island_parent[body];
+    }
+
+    return body;
+}
+
+void CollisionHandler::update_sleeping()
+{
+    // Count how long each awake body has been resting
+    m_bodies.clear();
+    for (auto col : m_dynamic_colliders)
+    {
+        col->m_body_index = no_island;
+
+        if (col->m_sleeping || !col->alive() || !col->active ||
+            col->trigger_only)
+        {
+            continue;
+        }
+
+        glm::vec2 pos = col->entity()->get_pos();
+        bool resting = glm::length2(pos - col->m_rest_pos) <=
+                       rest_tolerance * rest_tolerance;
+
+        // A body pushed into a static collider keeps its position, but is
+        // moved back in every frame
+        Mover *mover = col->get<Mover>();
+        if (mover)
+        {
+            bool driven = mover->approach_target && mover->target_speed > 0.0f;
+            resting = resting && !driven &&
+                      glm::length2(mover->vel) <= rest_speed * rest_speed;
+        }
+
+        // Turning or resizing in place isn't resting either
+        resting = resting && col->m_rotation == col->m_rest_rotation &&
+                  col->m_bounds.bl == col->m_rest_bounds.bl &&
+                  col->m_bounds.tr == col->m_rest_bounds.tr;
+
+        col->m_rest_frames = resting ? col->m_rest_frames + 1 : 0;
+        col->m_rest_pos = pos;
+        col->m_rest_rotation = col->m_rotation;
+        col->m_rest_bounds = col->m_bounds;
+        col->m_body_index = m_bodies.size();
+        m_bodies.push_back(col);
+    }
+
+    // Bodies in contact with each other form an island
+    m_island_parent.resize(m_bodies.size());
+    for (uint32_t i = 0; i < m_bodies.size(); i++)
+    {
+        m_island_parent[i] = i;
+    }
+
+    for (const auto &contact : m_contacts)
+    {
+        uint32_t a = contact.first.a->m_body_index;
+        uint32_t b = contact.first.b->m_body_index;
+
+        if (contact.second.frame == m_frame && a != no_island &&
+            b != no_island)
+        {
+            m_island_parent[find_island_root(a)] = find_island_root(b);
+        }
+    }
+
+    // An island falls asleep once all of its bodies have been resting long
+    // enough
+    m_island_resting.assign(m_bodies.size(), true);
+    for (uint32_t i = 0; i < m_bodies.size(); i++)
+    {
+        if (m_bodies[i]->m_rest_frames < sleep_frames)
+        {
+            m_island_resting[find_island_root(i)] = false;
+        }
+    }
+
+    m_root_island.assign(m_bodies.size(), no_island);
+    for (uint32_t i = 0; i < m_bodies.size(); i++)
+    {
+        uint32_t root = find_island_root(i);
+        if (!m_island_resting[root])
+            continue;
+
+        if (m_root_island[root] == no_island)
+        {
+            if (m_free_islands.empty())
+            {
+                m_root_island[root] = m_islands.size();
+                m_islands.emplace_back();
+            }
+            else
+            {
+                m_root_island[root] = m_free_islands.back();
+                m_free_islands.pop_back();
+            }
+        }
+
+        Collider *col = m_bodies[i];
+        col->m_sleeping = true;
+        col->m_island = m_root_island[root];
+        m_islands[col->m_island].push_back(col);
+    }
+}
+
+CollisionHandler::Contact *CollisionHandler::add_contact(Collider *col,
+                                                        Collider *ocol,
+                                                        const glm::vec2 &dir)
+{
+    // Order the pair so that both directions map to the same contact
+    ContactKey key = col < ocol ? ContactKey{col, ocol} : ContactKey{ocol, col};
+
+    auto it = m_contacts.find(key);
+    if (it != m_contacts.end())
+    {
+        ITD_ASSERT(it->second.frame != m_frame,
+                   "Contact has already been added this frame");
+        it->second.frame = m_frame;
+        return &it->second;
+    }
+
+    Contact *contact = &m_contacts[key];
+    col->m_contacts.push_back(ocol);
+    ocol->m_contacts.push_back(col);
+
+    *contact = {
+        .normal = col < ocol ? dir : -dir,
+        .impulse = 0.0f,
+        .frame = m_frame,
+    };
+
+    if ((col->collides_with & ocol->mask) && col->on_contact_enter)
+    {
+        col->on_contact_enter(col, ocol, dir);
+    }
+
+    if ((ocol->collides_with & col->mask) && ocol->on_contact_enter)
+    {
+        ocol->on_contact_enter(ocol, col, -dir);
+    }
+
+    return contact;
+}
+
+void CollisionHandler::remove_contacts(Collider *collider)
+{
+    // Swapped out, since the callbacks could add contacts to the collider
+    std::vector<Collider *> others;
+    others.swap(collider->m_contacts);
+
+    for (auto other : others)
+    {
+        ContactKey key = collider < other ? ContactKey{collider, other}
+                                          : ContactKey{other, collider};
+        m_contacts.erase(key);
+        unlink_contact(other, collider);
+
+        if (other->alive() && (other->collides_with & collider->mask) &&
+            other->on_contact_exit)
+        {
+            other->on_contact_exit(other, collider);
+        }
+    }
+}
+
+void CollisionHandler::unlink_contact(Collider *collider, Collider *other)
+{
+    std::vector<Collider *> &contacts = collider->m_contacts;
+    auto it = std::find(contacts.begin(), contacts.end(), other);
+    if (it != contacts.end())
+    {
+        *it = contacts.back();
+        contacts.pop_back();
+    }
+}
+
+void CollisionHandler::remove_stale_contacts()
+{
+    for (auto it = m_contacts.begin(); it != m_contacts.end();)
+    {
+        Collider *a = it->first.a;
+        Collider *b = it->first.b;
+
+        // Contacts of sleeping bodies are kept until something wakes them up
+        bool a_awake = a->m_dynamic && !a->m_sleeping;
+        bool b_awake = b->m_dynamic && !b->m_sleeping;
+        bool asleep = (a->m_sleeping || b->m_sleeping) && !a_awake && !b_awake;
+
+        if (it->second.frame != m_frame && !asleep)
+        {
+            unlink_contact(a, b);
+            unlink_contact(b, a);
+
+            if ((a->collides_with & b->mask) && a->on_contact_exit)
+            {
+                a->on_contact_exit(a, b);
+            }
+
+            if ((b->collides_with & a->mask) && b->on_contact_exit)
+            {
+                b->on_contact_exit(b, a);
+            }
+
+            it = m_contacts.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+Collider *CollisionHandler::check(Collider *collider, uint32_t mask)
+{
+    // The buckets hold the bounding boxes of the other colliders as of
+    // their last refresh
+    refresh_dirty();
+
+    if (!collider->m_in_bucket)
+        return nullptr;
+
+    Collider *result = nullptr;
+    for_each_in_buckets(collider->bbox(),
+                        [&](Collider *other, const Rectf &bbox) {
+                            if (!result && collider != other &&
+                                (mask & other->mask) &&
+                                collider->overlaps(*other))
+                            {
+                                result = other;
+                            }
+                        });
+
+    return result;
+}
+
+void CollisionHandler::check_all(Collider *collider, uint32_t mask,
+                                 std::vector<Collider *> *out)
+{
+    refresh_dirty();
+
+    if (!collider->m_in_bucket)
+        return;
+
+    for_each_in_buckets(collider->bbox(),
+                        [&](Collider *other, const Rectf &bbox) {
+                            if (collider != other && (mask & other->mask) &&
+                                collider->overlaps(*other))
+                            {
+                                out->push_back(other);
+                            }
+                        });
+}
+
+void CollisionHandler::query(const Rectf &bbox, std::vector<Collider *> *out)
+{
+    refresh_dirty();
+
+    // The current bounding box, the flat grid keeps the one it was built
+    // with
+    for_each_in_buckets(bbox, [&](Collider *other, const Rectf &obbox) {
+        if (other->active && bbox.overlaps(other->m_bbox))
+        {
+            out->push_back(other);
+        }
+    });
+}
+
+bool CollisionHandler::in_grid(const Collider *collider) const
+{
+    if (!collider->m_in_bucket)
+        return false;
+
+    // Added since the flat grid was built
+    if (m_grid_mode == GridMode::Rebuild &&
+        collider->m_flat_index == Collider::no_flat_index)
+    {
+        return false;
+    }
+
+    uint8_t level = collider->m_level;
+    const Recti &buc_box = collider->m_bucket_box;
+
+    // Only the sparse grid has cells outside the map
+    if (m_grid_mode != GridMode::Sparse &&
+        (!valid_bucket_index(level, buc_box.bl.x, buc_box.bl.y) ||
+         !valid_bucket_index(level, buc_box.tr.x, buc_box.tr.y)))
+    {
+        return false;
+    }
+
+    Recti current = bucket_box(collider->m_bbox, level);
+    return buc_box.contains(current.bl) && buc_box.contains(current.tr);
+}
+
+void CollisionHandler::render_dynamic_buckets(Renderer *renderer)
+{
+    for (auto d : m_dynamic_colliders)
+    {
+        const Recti &buc_box = d->m_bucket_box;
+        const glm::ivec2 &bl = buc_box.bl;
+        const glm::ivec2 &tr = buc_box.tr;
+
+        for (int y = bl.y; y <= tr.y; y++)
+        {
+            for (int x = bl.x; x <= tr.x; x++)
+            {
+                float cell_size = m_levels[d->m_level].cell_size;
+                glm::vec2 pos = glm::vec2(x, y) * cell_size;
+                renderer->rect(pos, pos + glm::vec2(1.0f, 1.0f) * cell_size,
+                               Color::green);
+            }
+        }
+    }
+}
+
+void CollisionHandler::render_bucket_heatmap(Renderer *renderer)
+{
+    if (m_stats.max_bucket_occupancy == 0)
+        return;
+
+    // Blue for a single entry, red for the fullest cell
+    float max_count = m_stats.max_bucket_occupancy;
+    for_each_occupied_cell([&](uint8_t level, int bx, int by, size_t count) {
+        float heat = count / max_count;
+        Color color((uint8_t)(255 * heat), 0, (uint8_t)(255 * (1.0f - heat)),
+                    (uint8_t)(64 + 128 * heat));
+
+        float cell_size = m_levels[level].cell_size;
+        glm::vec2 pos = glm::vec2(bx, by) * cell_size;
+        renderer->rect(pos, pos + glm::vec2(1.0f, 1.0f) * cell_size, color);
+    });
 }
 
 void CollisionHandler::render_collider_outlines(Renderer *renderer)
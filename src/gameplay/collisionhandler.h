@@ -1,6 +1,7 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <list>
+#include <unordered_map>
 #include <vector>
 #include "../graphics/renderer.h"
 #include "../maths/shapes.h"
@@ -9,31 +10,206 @@ namespace ITD {
 
 class Scene;
 class Collider;
+class Mover;
+
+struct GridMode {
+    // Colliders are moved between buckets as they move
+    static constexpr uint8_t Incremental = 0;
+    // All colliders are sorted into a flat cell array every update
+    static constexpr uint8_t Rebuild = 1;
+    // Like incremental, but only occupied cells are stored in a hash table,
+    // so colliders outside of the map keep colliding
+    static constexpr uint8_t Sparse = 2;
+};
+
+// Counters of the last update, occupancy is counted over non-empty cells
+struct CollisionStats {
+    uint32_t broadphase_candidates;
+    uint32_t sat_tests;
+    uint32_t overlaps;
+    uint32_t resolutions;
+    uint32_t rebucket_ops;
+    uint32_t occupied_cells;
+    uint32_t max_bucket_occupancy;
+    float mean_bucket_occupancy;
+};
 
 class CollisionHandler
 {
 private:
-    static constexpr size_t collision_iterations = 1;
+    static constexpr size_t default_solver_iterations = 4;
     static constexpr float collision_elasticity = 0.01f;
+    // Fraction of last frame's impulse applied before solving, contacts
+    // whose normal turned more than warm_start_min_dot start from zero
+    static constexpr float warm_start_factor = 0.8f;
+    static constexpr float warm_start_min_dot = 0.9f;
+    static constexpr uint32_t no_solver_body = UINT32_MAX;
+    static constexpr float default_cell_size = 16.0f;
+    static constexpr float min_cell_size = 8.0f;
+    static constexpr float max_cell_size = 256.0f;
+    static constexpr uint32_t auto_tune_interval = 600;
+    static constexpr size_t max_grid_levels = 4;
+    static constexpr size_t sparse_min_capacity = 256;
+    static constexpr uint32_t sparse_compact_interval = 120;
+    static constexpr uint32_t no_bucket = UINT32_MAX;
+    static constexpr uint64_t empty_sparse_key = UINT64_MAX;
+
+    // A body is resting if it moves less than rest_tolerance in a frame, is
+    // slower than rest_speed after the solve and isn't driven by its mover.
+    // It sleeps once its whole island has been resting for sleep_frames
+    static constexpr float rest_tolerance = 0.05f;
+    static constexpr float rest_speed = 1.0f;
+    static constexpr uint32_t sleep_frames = 30;
+    static constexpr float wake_distance = 0.5f;
+    static constexpr uint32_t no_island = UINT32_MAX;
+
+    struct ContactKey {
+        Collider *a;
+        Collider *b;
+
+        bool operator==(const ContactKey &other) const;
+    };
+
+    struct ContactKeyHash {
+        size_t operator()(const ContactKey &key) const;
+    };
+
+    // Persistent contact between two overlapping colliders, the normal is the
+    // push out direction of a
+    struct Contact {
+        glm::vec2 normal;
+        float impulse;
+        uint32_t frame;
+    };
+
+    // Body taking part in this frame's solve, the shift is applied to the
+    // entity once all iterations are done
+    struct SolverBody {
+        Collider *collider;
+        Mover *mover;
+        glm::vec2 shift;
+    };
+
+    // Contact gathered for the solver, b is no_solver_body for static
+    // colliders. The normal is the push out direction of a
+    struct SolverContact {
+        uint32_t a;
+        uint32_t b;
+        glm::vec2 normal;
+        float depth;
+        float impulse;
+        Contact *contact;
+    };
+
+    // Overlap found while gathering, on_collide is called once the solver
+    // has moved the bodies. The normal is the push out direction of a
+    struct Collision {
+        Collider *a;
+        Collider *b;
+        glm::vec2 normal;
+    };
+
+    // Cell entry of the flat grid, keeps a copy of the bounding box so that
+    // the broadphase doesn't have to touch the collider
+    struct FlatEntry {
+        uint32_t index;
+        Rectf bbox;
+    };
+
+    // Grid level covering the map, the cells of all levels are stored in the
+    // same bucket array starting at offset
+    struct GridLevel {
+        float cell_size;
+        float inv_cell_size;
+        size_t width;
+        size_t height;
+        size_t offset;
+    };
+
+    // Bucket entry, ref is the index of the cell in the collider's cell list
+    struct BucketEntry {
+        Collider *collider;
+        uint32_t ref;
+    };
+
+    // Open addressing hash table slot, maps a cell to its bucket
+    struct SparseSlot {
+        uint64_t key;
+        uint32_t bucket;
+    };
 
     Scene *m_scene;
-    std::vector<std::vector<Collider *>> m_buckets;
-    size_t m_grid_width;
-    size_t m_grid_height;
+    uint8_t m_grid_mode;
+    float m_cell_size;
+    bool m_auto_tune;
+    std::vector<GridLevel> m_levels;
+    size_t m_cell_count;
+    std::vector<std::vector<BucketEntry>> m_buckets;
+
+    // Sparse grid, m_sparse_keys holds the cell key of each bucket
+    std::vector<SparseSlot> m_sparse_slots;
+    std::vector<uint64_t> m_sparse_keys;
+
+    // Flat grid in compressed sparse row format, the entries of cell i are
+    // in the range [m_flat_cell_start[i], m_flat_cell_start[i + 1])
+    std::vector<Collider *> m_flat_colliders;
+    std::vector<uint32_t> m_flat_cell_start;
+    std::vector<uint32_t> m_flat_cursor;
+    std::vector<FlatEntry> m_flat_entries;
 
     std::list<Collider *> m_dynamic_colliders;
 
+    // Colliders that have moved or changed shape since they were refreshed
+    std::vector<Collider *> m_dirty;
+
+    std::unordered_map<ContactKey, Contact, ContactKeyHash> m_contacts;
+    uint32_t m_frame;
+
+    CollisionStats m_stats;
+    uint32_t m_rebucket_ops;
+
+    size_t m_solver_iterations;
+    std::vector<SolverBody> m_solver_bodies;
+    std::vector<SolverContact> m_solver_contacts;
+    std::vector<Collision> m_collisions;
+
+    // Sleeping islands, and scratch buffers used when finding new ones
+    std::vector<std::vector<Collider *>> m_islands;
+    std::vector<uint32_t> m_free_islands;
+    std::vector<Collider *> m_moved_static;
+    std::vector<Collider *> m_bodies;
+    std::vector<uint32_t> m_island_parent;
+    std::vector<bool> m_island_resting;
+    std::vector<uint32_t> m_root_island;
+
 public:
     CollisionHandler();
 
-    void init(Scene *scene);
+    // A cell size of 0 tunes the cell size to the colliders in the scene
+    void init(Scene *scene, float cell_size = 0.0f);
+
+    void set_grid_mode(uint8_t mode);
+    uint8_t grid_mode() const;
+
+    void set_cell_size(float size);
+    float cell_size() const;
+    void set_auto_tune(bool auto_tune);
+
+    // More iterations settle stacks of bodies better, at a higher cost
+    void set_solver_iterations(size_t iterations);
+    size_t solver_iterations() const;
 
     void register_dynamic(Collider *collider);
     void deregister_dynamic(Collider *collider);
 
+    void mark_dirty(Collider *collider);
+
+    // Recalculates the shapes of all moved colliders now instead of when
+    // they are next read
+    void refresh_dirty();
     void update_buckets(Collider *collider);
-    void add_bucket(Collider *collider, size_t bx, size_t by);
-    void remove_bucket(Collider *collider, size_t bx, size_t by);
+    void add_bucket(Collider *collider, uint8_t level, int bx, int by);
+    void remove_bucket(Collider *collider, uint32_t ref);
     void remove(Collider *collider);
 
     void update();
@@ -41,14 +217,67 @@ public:
     void check_all(Collider *collider, uint32_t mask,
                    std::vector<Collider *> *out);
 
+    // Adds the active colliders with a bounding box overlapping bbox. A
+    // collider spanning several cells can be added more than once
+    void query(const Rectf &bbox, std::vector<Collider *> *out);
+
+    // Whether query finds the collider at its current bounding box. Not the
+    // case outside the map, or after moving out of the cells it was last
+    // sorted into
+    bool in_grid(const Collider *collider) const;
+
+    const CollisionStats &stats() const;
+
     void render_dynamic_buckets(Renderer *renderer);
+    void render_bucket_heatmap(Renderer *renderer);
     void render_collider_outlines(Renderer *renderer);
 
 private:
-    glm::ivec2 bucket_index(const glm::vec2 &pos);
-    Recti bucket_box(const Rectf &bbox);
+    uint8_t grid_level(const Rectf &bbox) const;
+    glm::ivec2 bucket_index(const glm::vec2 &pos, uint8_t level) const;
+    Recti bucket_box(const Rectf &bbox, uint8_t level) const;
     void update_all_buckets();
-    bool valid_bucket_index(size_t bx, size_t by);
+    void rebuild_flat_grid();
+    void reset_grid();
+    void tune_cell_size();
+    bool valid_bucket_index(uint8_t level, int bx, int by) const;
+    size_t cell_index(uint8_t level, int bx, int by) const;
+
+    // Returns no_bucket if the cell has no bucket, get_bucket creates one in
+    // the sparse grid
+    uint32_t find_bucket(uint8_t level, int bx, int by) const;
+    uint32_t get_bucket(uint8_t level, int bx, int by);
+
+    void rebuild_sparse_table(size_t capacity);
+    void compact_sparse_grid();
+    static uint64_t sparse_key(uint8_t level, int bx, int by);
+    static size_t sparse_hash(uint64_t key);
+
+    // Calls fn for every collider in the buckets overlapping bbox, on all
+    // levels
+    template <class F>
+    void for_each_in_buckets(const Rectf &bbox, F fn);
+
+    // Calls fn with the number of entries of every non-empty cell
+    template <class F>
+    void for_each_occupied_cell(F fn) const;
+
+    void count_occupancy();
+
+    void gather_contacts();
+    uint32_t solver_body(Collider *collider);
+    void solve_contacts();
+    void dispatch_collisions();
+
+    Contact *add_contact(Collider *col, Collider *ocol, const glm::vec2 &dir);
+    void remove_contacts(Collider *collider);
+    static void unlink_contact(Collider *collider, Collider *other);
+    void remove_stale_contacts();
+
+    void wake(Collider *collider);
+    void wake_disturbed();
+    uint32_t find_island_root(uint32_t body);
+    void update_sleeping();
 };
 
 }  // namespace ITD
@@ -1,4 +1,5 @@
 #include "content.h"
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include "../platform.h"
@@ -6,6 +7,8 @@
 namespace ITD {
 namespace {
     std::unordered_map<std::string, Sound> g_sounds;
+    std::unordered_map<std::string, Subtexture> g_sprites;
+    std::unique_ptr<Atlas> g_atlas;
 }
 
 Sound *Content::find_sound(const std::string &name)
@@ -21,4 +24,29 @@ Sound *Content::find_sound(const std::string &name)
     return &g_sounds[name];
 }
 
+const Subtexture &Content::find_sprite(const std::string &name)
+{
+    auto it = g_sprites.find(name);
+    if (it == g_sprites.end())
+    {
+        std::string path = Platform::app_path() + "../res/" + name + ".png";
+        Image img(path);
+
+        it = g_sprites.emplace(name, atlas()->add(img)).first;
+    }
+
+    return it->second;
+}
+
+Atlas *Content::atlas()
+{
+    // Created on first use, since it needs the graphics context
+    if (!g_atlas)
+    {
+        g_atlas = std::make_unique<Atlas>();
+    }
+
+    return g_atlas.get();
+}
+
 }  // namespace ITD
@@ -1,9 +1,14 @@
 #pragma once
+#include "../graphics/atlas.h"
 #include "../sound.h"
 
 namespace ITD {
 namespace Content {
 
     Sound *find_sound(const std::string &name);
+
+    // Sprites are packed into the shared atlas the first time they are found
+    const Subtexture &find_sprite(const std::string &name);
+    Atlas *atlas();
 }
 }  // namespace ITD
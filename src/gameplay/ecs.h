@@ -3,6 +3,7 @@
 #include <vector>
 #include "../debug.h"
 #include "../graphics/renderer.h"
+#include "../workerpool.h"
 #include "collisionhandler.h"
 #include "particlesystem.h"
 
@@ -16,6 +17,21 @@ struct Property {
     static constexpr uint8_t Updatable = 1;
     static constexpr uint8_t Renderable = 1 << 1;
     static constexpr uint8_t HUD = 1 << 2;
+    // Rendered once into the static mesh of the scene, which is rebuilt
+    // when components of the type are added or removed
+    static constexpr uint8_t Static = 1 << 3;
+};
+
+// Draw order of the scene. Draws within a layer are sorted by render state,
+// so all renderable components share one layer and batch together
+struct Layer {
+    static constexpr uint16_t Tilemap = 0;
+    static constexpr uint16_t Static = 1;
+    static constexpr uint16_t Heatmap = 2;
+    static constexpr uint16_t Components = 3;
+    static constexpr uint16_t Particles = 4;
+    static constexpr uint16_t Outlines = 5;
+    static constexpr uint16_t HUD = 6;
 };
 
 class Component
@@ -97,6 +113,10 @@ private:
 
     uint32_t m_id;
 
+    // Culling result, valid when the frame matches the scene's
+    uint32_t m_cull_frame;
+    bool m_in_view;
+
 public:
     Entity(const glm::vec2 &pos);
     ~Entity();
@@ -159,13 +179,34 @@ private:
 
     Rectf m_world_bounds;
 
+    // Renderable components of entities outside the view are not rendered.
+    // Large scenes find the colliders in view through the collision grid
+    // instead of testing every entity
+    static constexpr size_t min_grid_cull_entities = 512;
+    Rectf m_view;
+    uint32_t m_cull_frame;
+    bool m_cull_grid;
+    std::vector<Collider *> m_cull_list;
+
+    Mesh m_static_mesh;
+    bool m_static_dirty;
+
+    // Components are only rendered on several threads when each thread
+    // gets at least this many
+    static constexpr size_t min_thread_components = 256;
+    std::vector<Component *> m_render_list;
+    std::vector<Renderer *> m_recorders;
+    WorkerPool m_workers;
+
     bool m_debug;
 
 
     static inline uint8_t s_prop_masks[max_component_types] = {Property::None};
 
 public:
-    Scene(Tilemap *map, const Rectf &world_bounds);
+    // A collision cell size of 0 tunes it to the colliders in the scene
+    Scene(Tilemap *map, const Rectf &world_bounds,
+          float collision_cell_size = 0.0f);
     ~Scene();
 
     template <class T>
@@ -198,8 +239,15 @@ public:
     Rectf world_bounds() const;
     void toggle_debug_mode();
 
+    // Area of the world that is on screen, the world bounds by default
+    void set_view(const Rectf &view);
+    Rectf view() const;
+
 private:
     void update_lists();
+    void render_components(Renderer *renderer, uint8_t prop_mask);
+    void cull();
+    bool in_view(Entity *entity);
 };
 
 template <class T>
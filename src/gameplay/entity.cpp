@@ -10,6 +10,8 @@ Entity::Entity(const glm::vec2 &pos)
     , visible(true)
     , m_scene(nullptr)
     , m_alive(true)
+    , m_cull_frame(0)
+    , m_in_view(true)
 {
 }
 
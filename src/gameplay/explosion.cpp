@@ -56,12 +56,10 @@ Entity *Explosion::create(Scene *scene, const glm::vec2 &pos, float duration,
         new Collider(Rectf(-size / 2.0f, size / 2.0f), rotation, false);
     col->collides_with = hurt_mask;
     col->trigger_only = true;
-    col->on_collide = [](Collider *collider, Collider *other,
-                         const glm::vec2 &dir) {
+    col->on_contact_enter = [](Collider *collider, Collider *other,
+                               const glm::vec2 &dir) {
         Explosion *exp = collider->get<Explosion>();
         exp->on_hit(other, dir);
-
-        return true;
     };
 
     ent->add(col);
@@ -52,7 +52,7 @@ void ParticleSystem::render(Renderer *renderer)
     for (size_t i = 0; i < m_particle_count; i++)
     {
         Particle &p = m_particles[i];
-        renderer->circ(p.pos, p.radius, 16, Color::green);
+        renderer->circ(p.pos, p.radius, Color::green);
     }
 }
 
@@ -10,6 +10,7 @@
 #include "content.h"
 #include "hurtable.h"
 #include "mover.h"
+#include "renderbounds.h"
 #include "torpedo.h"
 
 namespace ITD {
@@ -244,6 +245,12 @@ Entity *Player::create(Scene *scene, const glm::vec2 &pos)
     col->collides_with = Mask::Solid | Mask::Enemy;
     ent->add(col);
 
+    // The scaled body and wings reach outside the collider at any rotation
+    glm::vec2 center = col->get_bounds().center();
+    float reach = 16.0f;
+    ent->add(new RenderBounds(
+        Rectf(center - glm::vec2(reach), center + glm::vec2(reach))));
+
     Mover *mov = new Mover();
     ent->add(mov);
 
@@ -0,0 +1,15 @@
+#include "renderbounds.h"
+
+namespace ITD {
+
+RenderBounds::RenderBounds(const Rectf &bounds)
+    : bounds(bounds)
+{
+}
+
+Rectf RenderBounds::world_bounds() const
+{
+    return bounds + m_entity->get_pos();
+}
+
+}  // namespace ITD
@@ -0,0 +1,20 @@
+#pragma once
+#include "../maths/shapes.h"
+#include "ecs.h"
+
+namespace ITD {
+
+// Area the entity draws in, relative to its position. Entities without it
+// are culled by their collider's bounding box
+class RenderBounds : public Component
+{
+public:
+    Rectf bounds;
+
+public:
+    RenderBounds(const Rectf &bounds);
+
+    Rectf world_bounds() const;
+};
+
+}  // namespace ITD
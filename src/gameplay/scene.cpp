@@ -1,7 +1,10 @@
 #include <algorithm>
+#include <thread>
+#include "collider.h"
 #include "ecs.h"
-#include "tilemap.h"
 #include "player.h"
+#include "renderbounds.h"
+#include "tilemap.h"
 
 namespace ITD {
 
@@ -11,15 +14,21 @@ Scene::EntityRef::EntityRef()
 {
 }
 
-Scene::Scene(Tilemap *map, const Rectf &world_bounds)
+Scene::Scene(Tilemap *map, const Rectf &world_bounds,
+             float collision_cell_size)
     : m_tilemap(map)
     , m_freeze_timer(0.0f)
     , m_world_bounds(world_bounds)
+    , m_view(world_bounds)
+    , m_cull_frame(0)
+    , m_cull_grid(false)
+    , m_static_dirty(true)
+    , m_workers(std::max(std::thread::hardware_concurrency(), 1u) - 1)
     , m_debug(false)
     , m_entity_registry_tail(0)
 {
     map->fill_scene(this);
-    m_collision_handler.init(this);
+    m_collision_handler.init(this, collision_cell_size);
 }
 
 Scene::~Scene()
@@ -52,12 +61,22 @@ void Scene::track_component(Component *component)
 {
     m_components[component->type()].push_back(component);
     component->m_iterator = --m_components[component->type()].end();
+
+    if (s_prop_masks[component->type()] & Property::Static)
+    {
+        m_static_dirty = true;
+    }
 }
 
 void Scene::untrack_component(Component *component)
 {
     assert(component->scene() == this);
     m_components[component->type()].erase(component->m_iterator);
+
+    if (s_prop_masks[component->type()] & Property::Static)
+    {
+        m_static_dirty = true;
+    }
 }
 
 Entity *Scene::get_entity(uint32_t id)
@@ -168,50 +187,125 @@ void Scene::update_lists()
 
 void Scene::render(Renderer *renderer)
 {
-    m_tilemap->render(renderer);
+    renderer->set_layer(Layer::Tilemap);
+    m_tilemap->render(renderer, m_view);
 
-    if (m_debug)
+    renderer->set_layer(Layer::Static);
+
+    if (m_static_dirty)
     {
-        m_collision_handler.render_dynamic_buckets(renderer);
+        renderer->begin_mesh(&m_static_mesh);
+        render_components(renderer, Property::Static);
+        renderer->end_mesh();
+
+        m_static_dirty = false;
     }
 
-    for (size_t i = 0; i < Component::Types::count(); i++)
+    renderer->mesh(&m_static_mesh);
+
+    if (m_debug)
     {
-        if (s_prop_masks[i] & Property::Renderable)
-        {
-            for (auto comp : m_components[i])
-            {
-                if (comp->visible && comp->entity()->visible)
-                {
-                    comp->render(renderer);
-                }
-            }
-        }
+        renderer->set_layer(Layer::Heatmap);
+        m_collision_handler.render_bucket_heatmap(renderer);
     }
 
+    renderer->set_layer(Layer::Components);
+    cull();
+    render_components(renderer, Property::Renderable);
+
+    renderer->set_layer(Layer::Particles);
     m_particle_system.render(renderer);
 
     if (m_debug)
     {
+        renderer->set_layer(Layer::Outlines);
         m_collision_handler.render_collider_outlines(renderer);
     }
 }
 
 void Scene::render_hud(Renderer *renderer)
 {
+    renderer->set_layer(Layer::HUD);
+    render_components(renderer, Property::HUD);
+
+    if (m_debug)
+    {
+        Rectf bounds = m_world_bounds;
+        bounds.bl.y = bounds.tr.y - (bounds.tr.y - bounds.bl.y) * 0.25f;
+        renderer->render_stats(bounds);
+    }
+}
+
+void Scene::render_components(Renderer *renderer, uint8_t prop_mask)
+{
+    m_render_list.clear();
+
     for (size_t i = 0; i < Component::Types::count(); i++)
     {
-        if (s_prop_masks[i] & Property::HUD)
+        // Static components are only rendered into the static mesh
+        uint8_t props = s_prop_masks[i];
+        if (!(props & prop_mask) ||
+            (prop_mask != Property::Static && (props & Property::Static)))
         {
-            for (auto comp : m_components[i])
+            continue;
+        }
+
+        // The static mesh and the HUD are not culled
+        bool culled = prop_mask == Property::Renderable;
+
+        for (auto comp : m_components[i])
+        {
+            Entity *entity = comp->entity();
+            if (comp->visible && entity->visible &&
+                (!culled || in_view(entity)))
             {
-                if (comp->visible && comp->entity()->visible)
-                {
-                    comp->render(renderer);
-                }
+                m_render_list.push_back(comp);
             }
         }
     }
+
+    size_t threads = std::min<size_t>(m_workers.size(),
+                                      m_render_list.size() /
+                                          min_thread_components);
+
+    // Meshes can only be recorded by the main renderer
+    if (threads <= 1 || prop_mask == Property::Static)
+    {
+        for (auto comp : m_render_list)
+        {
+            comp->render(renderer);
+        }
+
+        return;
+    }
+
+    // Colliders are otherwise refreshed when first read, which isn't safe
+    // to do from several threads
+    m_collision_handler.refresh_dirty();
+
+    // Recorders can only be made on this thread
+    m_recorders.clear();
+    for (size_t i = 0; i < threads; i++)
+    {
+        m_recorders.push_back(renderer->recorder(i));
+    }
+
+    // Every job records a chunk of the list into its own recorder, and the
+    // recorders are merged in list order, so the result is the same as
+    // rendering on one thread
+    size_t chunk = (m_render_list.size() + threads - 1) / threads;
+
+    m_workers.run(threads, [this, chunk](size_t i) {
+        size_t first = i * chunk;
+        size_t last = std::min(first + chunk, m_render_list.size());
+
+        for (size_t j = first; j < last; j++)
+        {
+            m_render_list[j]->render(m_recorders[i]);
+        }
+    });
+
+    renderer->merge_recorders(threads);
 }
 
 void Scene::freeze(float amount)
@@ -239,6 +333,73 @@ Rectf Scene::world_bounds() const
     return m_world_bounds;
 }
 
+void Scene::set_view(const Rectf &view)
+{
+    m_view = view;
+}
+
+Rectf Scene::view() const
+{
+    return m_view;
+}
+
+void Scene::cull()
+{
+    // Results of the previous frame become invalid
+    m_cull_frame++;
+    m_cull_grid = m_entities.size() >= min_grid_cull_entities;
+
+    if (!m_cull_grid)
+        return;
+
+    // Entities found here are in view, other entities with an active
+    // collider are only tested if the grid doesn't cover their collider
+    m_cull_list.clear();
+    m_collision_handler.query(m_view, &m_cull_list);
+
+    for (auto col : m_cull_list)
+    {
+        Entity *entity = col->entity();
+        if (entity->m_cull_frame == m_cull_frame ||
+            entity->get<Collider>() != col || entity->get<RenderBounds>())
+        {
+            continue;
+        }
+
+        entity->m_cull_frame = m_cull_frame;
+        entity->m_in_view = true;
+    }
+}
+
+bool Scene::in_view(Entity *entity)
+{
+    if (entity->m_cull_frame == m_cull_frame)
+        return entity->m_in_view;
+
+    entity->m_cull_frame = m_cull_frame;
+
+    RenderBounds *bounds = entity->get<RenderBounds>();
+    Collider *col = entity->get<Collider>();
+
+    if (bounds)
+    {
+        entity->m_in_view = bounds->world_bounds().overlaps(m_view);
+    }
+    else if (col && col->active)
+    {
+        // Colliders the grid covers were found in cull if they are in view
+        bool found = m_cull_grid && m_collision_handler.in_grid(col);
+        entity->m_in_view = !found && col->bbox().overlaps(m_view);
+    }
+    else
+    {
+        // Nothing to tell where the entity draws
+        entity->m_in_view = true;
+    }
+
+    return entity->m_in_view;
+}
+
 void Scene::toggle_debug_mode()
 {
     m_debug = !m_debug;
@@ -2,6 +2,7 @@
 #include <iostream>
 #include "../file.h"
 #include "../platform.h"
+#include "content.h"
 #include "chaser.h"
 #include "player.h"
 #include "playerhud.h"
@@ -26,7 +27,7 @@ Tilemap::Tilemap(const std::string &name)
     std::string data_path = base_path + "data.json";
 
     Image img(img_path);
-    m_texture.load(img);
+    m_composite = Content::atlas()->add(img);
 
     m_igrid.load(igrid_path);
 
@@ -35,6 +36,47 @@ Tilemap::Tilemap(const std::string &name)
 
     m_width = m_data["width"].get<int>() / 8;
     m_height = m_data["height"].get<int>() / 8;
+
+    find_filled_tiles(img);
+
+    for (int cy = 0; cy < m_height; cy += chunk_tiles)
+    {
+        for (int cx = 0; cx < m_width; cx += chunk_tiles)
+        {
+            auto chunk = std::make_unique<Chunk>();
+            glm::ivec2 tr(std::min(cx + chunk_tiles, m_width) - 1,
+                          std::min(cy + chunk_tiles, m_height) - 1);
+            chunk->tiles = Recti(glm::ivec2(cx, cy), tr);
+            chunk->bounds = Rectf(glm::vec2(cx, cy) * (float)tile_size,
+                                  glm::vec2(tr + 1) * (float)tile_size);
+            chunk->built = false;
+
+            m_chunks.push_back(std::move(chunk));
+        }
+    }
+}
+
+void Tilemap::find_filled_tiles(const Image &img)
+{
+    m_filled.assign(m_width * m_height, false);
+
+    const Color *pixels = img.pixels();
+    for (size_t py = 0; py < img.height(); py++)
+    {
+        for (size_t px = 0; px < img.width(); px++)
+        {
+            if (pixels[px + py * img.width()].a == 0)
+                continue;
+
+            // Tiles are indexed from the bottom row like the world
+            int tx = px / tile_size;
+            int ty = m_height - 1 - (int)(py / tile_size);
+            if (tx < m_width && ty >= 0)
+            {
+                m_filled[tx + ty * m_width] = true;
+            }
+        }
+    }
 }
 
 void Tilemap::fill_scene(Scene *scene)
@@ -116,9 +158,52 @@ void Tilemap::fill_scene(Scene *scene)
     }
 }
 
-void Tilemap::render(Renderer *renderer)
+void Tilemap::render(Renderer *renderer, const Rectf &view)
 {
-    // renderer->tex(&m_texture, glm::vec2(), Color::white);
+    for (auto &chunk : m_chunks)
+    {
+        if (!chunk->bounds.overlaps(view))
+            continue;
+
+        if (!chunk->built)
+        {
+            build_chunk(renderer, chunk.get());
+        }
+
+        renderer->mesh(&chunk->mesh);
+    }
+}
+
+void Tilemap::build_chunk(Renderer *renderer, Chunk *chunk)
+{
+    renderer->begin_mesh(&chunk->mesh);
+
+    // The tile bounds of the subtexture are counted from the bottom of the
+    // composite image, like the world
+    glm::ivec2 origin = m_composite.get_bounds().bl;
+    Subtexture tile(m_composite.get_texture(),
+                    Recti(origin, origin + glm::ivec2(tile_size - 1)));
+
+    const Recti &tiles = chunk->tiles;
+    for (int y = tiles.bl.y; y <= tiles.tr.y; y++)
+    {
+        for (int x = tiles.bl.x; x <= tiles.tr.x; x++)
+        {
+            if (!m_filled[x + y * m_width])
+                continue;
+
+            glm::ivec2 bl = glm::ivec2(x, y) * tile_size;
+            tile.set_bounds(Recti(origin + bl,
+                                  origin + bl + glm::ivec2(tile_size - 1)));
+
+            glm::vec2 pos = glm::vec2(bl);
+            renderer->tex(tile, Rectf(pos, pos + (float)tile_size),
+                          Color::white);
+        }
+    }
+
+    renderer->end_mesh();
+    chunk->built = true;
 }
 
 size_t Tilemap::width() const
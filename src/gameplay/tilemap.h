@@ -1,4 +1,5 @@
 #pragma once
+#include <memory>
 #include "../graphics/renderer.h"
 #include "../third_party/json.hpp"
 #include "ecs.h"
@@ -8,23 +9,44 @@ namespace ITD {
 class Tilemap
 {
 private:
+    static constexpr int tile_size = 8;
+    static constexpr int chunk_tiles = 32;
+
+    // Square of tiles drawn from a mesh, built the first time it is visible
+    struct Chunk {
+        Recti tiles;
+        Rectf bounds;
+        Mesh mesh;
+        bool built;
+    };
+
     std::string m_name;
     int m_width, m_height;
-    Texture m_texture;
+    Subtexture m_composite;
     nlohmann::json m_data;
     Image m_igrid;
 
+    // Tiles of the composite image that have any visible pixels
+    std::vector<bool> m_filled;
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+
 public:
     Tilemap(const std::string &name);
 
     void fill_scene(Scene *scene);
-    void render(Renderer *renderer);
+
+    // Only draws the chunks overlapping view
+    void render(Renderer *renderer, const Rectf &view);
 
     size_t width() const;
     size_t height() const;
 
     float pixel_width() const;
     float pixel_height() const;
+
+private:
+    void find_filled_tiles(const Image &img);
+    void build_chunk(Renderer *renderer, Chunk *chunk);
 };
 
 }  // namespace ITD
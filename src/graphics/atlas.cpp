@@ -0,0 +1,166 @@
+#include "atlas.h"
+#include <algorithm>
+#include "../debug.h"
+
+namespace ITD {
+
+Atlas::Atlas(int page_size)
+{
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    m_max_size = max_size;
+    m_page_size = std::min(page_size, m_max_size);
+}
+
+Subtexture Atlas::add(const Image &image)
+{
+    int width = image.width() + padding;
+    int height = image.height() + padding;
+
+    ITD_ASSERT(width <= m_max_size && height <= m_max_size,
+               "Image is larger than the largest atlas page");
+
+    Page *page = nullptr;
+    size_t best_index = 0;
+    int best_y = -1;
+    int best_width = 0;
+
+    for (auto &candidate : m_pages)
+    {
+        const auto &skyline = candidate->skyline;
+        for (size_t i = 0; i < skyline.size(); i++)
+        {
+            int y = fit(candidate.get(), i, width, height);
+            if (y < 0)
+                continue;
+
+            // Prefer the lowest position, then the narrowest segment to
+            // leave less space unusable
+            if (best_y < 0 || y < best_y ||
+                (y == best_y && skyline[i].width < best_width))
+            {
+                page = candidate.get();
+                best_index = i;
+                best_y = y;
+                best_width = skyline[i].width;
+            }
+        }
+
+        if (page)
+            break;
+    }
+
+    if (!page)
+    {
+        // Images larger than a page get a page of their own
+        page = add_page(std::max(width, m_page_size),
+                        std::max(height, m_page_size));
+        best_index = 0;
+        best_y = 0;
+    }
+
+    int x = page->skyline[best_index].x;
+    insert(page, best_index, width, height);
+
+    page->texture.update(x, best_y, image.width(), image.height(),
+                         (const unsigned char *)image.pixels());
+
+    // The skyline grows from the first row of the texture, which is the top
+    // of the image, while subtexture bounds start at the bottom
+    int page_height = page->texture.height();
+    glm::ivec2 bl(x, page_height - best_y - (int)image.height());
+    glm::ivec2 tr = bl + glm::ivec2(image.width() - 1, image.height() - 1);
+
+    return Subtexture(&page->texture, Recti(bl, tr));
+}
+
+size_t Atlas::page_count() const
+{
+    return m_pages.size();
+}
+
+Atlas::Page *Atlas::add_page(int width, int height)
+{
+    Log::info("Adding %dx%d atlas page", width, height);
+
+    // Cleared so the padding between images is transparent
+    std::vector<unsigned char> pixels(width * height * 4, 0);
+
+    auto page = std::make_unique<Page>();
+    page->texture.load(width, height, pixels.data());
+    page->skyline.push_back({.x = 0, .y = 0, .width = width});
+
+    m_pages.push_back(std::move(page));
+    return m_pages.back().get();
+}
+
+int Atlas::fit(const Page *page, size_t index, int width, int height) const
+{
+    const auto &skyline = page->skyline;
+    int page_width = page->texture.width();
+    int page_height = page->texture.height();
+
+    if (skyline[index].x + width > page_width)
+        return -1;
+
+    int y = 0;
+    int remaining = width;
+    for (size_t i = index; remaining > 0; i++)
+    {
+        ITD_ASSERT(i < skyline.size(), "Skyline does not cover page");
+
+        y = std::max(y, skyline[i].y);
+        if (y + height > page_height)
+            return -1;
+
+        remaining -= skyline[i].width;
+    }
+
+    return y;
+}
+
+void Atlas::insert(Page *page, size_t index, int width, int height)
+{
+    auto &skyline = page->skyline;
+    int x = skyline[index].x;
+    int y = fit(page, index, width, height);
+
+    skyline.insert(skyline.begin() + index,
+                   {.x = x, .y = y + height, .width = width});
+
+    // Cut the segments now below the new one
+    size_t i = index + 1;
+    while (i < skyline.size())
+    {
+        Segment &segment = skyline[i];
+        int covered = x + width - segment.x;
+
+        if (covered <= 0)
+            break;
+
+        if (covered < segment.width)
+        {
+            segment.x += covered;
+            segment.width -= covered;
+            break;
+        }
+
+        skyline.erase(skyline.begin() + i);
+    }
+
+    // Merge neighbours at the same height
+    for (size_t j = 0; j + 1 < skyline.size();)
+    {
+        if (skyline[j].y == skyline[j + 1].y)
+        {
+            skyline[j].width += skyline[j + 1].width;
+            skyline.erase(skyline.begin() + j + 1);
+        }
+        else
+        {
+            j++;
+        }
+    }
+}
+
+}  // namespace ITD
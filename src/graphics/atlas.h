@@ -0,0 +1,56 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "image.h"
+#include "subtexture.h"
+#include "texture.h"
+
+namespace ITD {
+
+// Packs images into a few large textures, so sprites from different images
+// can be drawn without switching textures. Pages are filled with skyline
+// packing, and a new page is started when an image doesn't fit
+class Atlas
+{
+private:
+    static constexpr int padding = 1;
+
+    // Top edge of the packed area, from x to x + width
+    struct Segment {
+        int x;
+        int y;
+        int width;
+    };
+
+    struct Page {
+        Texture texture;
+        std::vector<Segment> skyline;
+    };
+
+    int m_page_size;
+    int m_max_size;
+    std::vector<std::unique_ptr<Page>> m_pages;
+
+public:
+    Atlas(int page_size = 2048);
+
+    Atlas(const Atlas &other) = delete;
+    Atlas &operator=(const Atlas &other) = delete;
+
+    // Returns the whole image. Bounds within the image are moved by the
+    // bottom left corner of the returned bounds. The image and its padding
+    // have to fit in the largest texture the GPU supports
+    Subtexture add(const Image &image);
+
+    size_t page_count() const;
+
+private:
+    Page *add_page(int width, int height);
+
+    // Returns the lowest y an image of width can be placed at on top of
+    // the segment at index, or -1 if it doesn't fit
+    int fit(const Page *page, size_t index, int width, int height) const;
+    void insert(Page *page, size_t index, int width, int height);
+};
+
+}  // namespace ITD
@@ -1,18 +1,27 @@
 #include "material.h"
 #include <string.h>
+#include "../debug.h"
 
 namespace ITD {
 
 Material::Material()
-    : m_shader(nullptr)
+    : m_id(s_next_id++)
+    , m_shader(nullptr)
 {
 }
 
 Material::Material(const Shader *shader)
+    : m_id(s_next_id++)
+    , m_shader(nullptr)
 {
     set_shader(shader);
 }
 
+uint32_t Material::id() const
+{
+    return m_id;
+}
+
 void Material::set_shader(const Shader *shader)
 {
     m_shader = shader;
@@ -21,20 +30,8 @@ void Material::set_shader(const Shader *shader)
     if (!shader)
         return;
 
-    size_t values_size = 0;
-    for (const auto &uniform : shader->uniforms())
-    {
-        if (uniform.type == GL_SAMPLER_2D)
-        {
-            m_textures.push_back(nullptr);
-        }
-        else
-        {
-            values_size += uniform_length(uniform);
-        }
-    }
-
-    m_values.resize(values_size);
+    m_textures.resize(shader->texture_count(), nullptr);
+    m_values.resize(shader->value_count());
 }
 
 const Shader *Material::shader() const
@@ -42,69 +39,50 @@ const Shader *Material::shader() const
     return m_shader;
 }
 
-bool Material::set_texture(const std::string &name, const Texture *texture,
-                           size_t slot)
+bool Material::set_texture(const std::string &name, const Texture *texture)
 {
-    for (const auto &uniform : m_shader->uniforms())
-    {
-        if (uniform.type != GL_SAMPLER_2D)
-            continue;
-
-        if (name == uniform.name)
-        {
-            m_textures[slot] = texture;
-            return true;
-        }
-    }
-
-    return false;
+    int index = m_shader->uniform_index(name);
+    if (index < 0 || m_shader->uniforms()[index].type != GL_SAMPLER_2D)
+        return false;
+
+    set_texture(index, texture);
+    return true;
 }
 
 bool Material::set_value(const std::string &name, const float *value)
 {
-    size_t offset = 0;
-    for (auto &uniform : m_shader->uniforms())
-    {
-        if (uniform.type == GL_SAMPLER_2D)
-            continue;
+    int index = m_shader->uniform_index(name);
+    if (index < 0 || m_shader->uniforms()[index].type == GL_SAMPLER_2D)
+        return false;
 
-        size_t length = uniform_length(uniform);
-
-        if (name == uniform.name)
-        {
-            memcpy(&m_values[offset], value, length * sizeof(float));
-            return true;
-        }
+    set_value(index, value);
+    return true;
+}
 
-        offset += length;
-    }
+void Material::set_texture(int index, const Texture *texture)
+{
+    const Uniform &uniform = m_shader->uniforms()[index];
+    ITD_ASSERT(uniform.type == GL_SAMPLER_2D, "Uniform is not a texture");
 
-    return false;
+    m_textures[uniform.offset] = texture;
 }
 
-const Texture *Material::get_texture(size_t slot) const
+void Material::set_value(int index, const float *value)
 {
-    return m_textures[slot];
+    const Uniform &uniform = m_shader->uniforms()[index];
+    ITD_ASSERT(uniform.type != GL_SAMPLER_2D, "Uniform is a texture");
+
+    memcpy(&m_values[uniform.offset], value, uniform.length * sizeof(float));
 }
 
-const std::vector<float> &Material::get_values() const
+const Texture *Material::get_texture(int index) const
 {
-    return m_values;
+    return m_textures[m_shader->uniforms()[index].offset];
 }
 
-size_t Material::uniform_length(const Uniform &uniform) const
+const float *Material::get_value(int index) const
 {
-    switch (uniform.type)
-    {
-        case GL_FLOAT:
-            return 1;
-        case GL_FLOAT_VEC2:
-            return 2;
-        case GL_FLOAT_MAT4:
-            return 16;
-    };
-
-    return 0;
+    return m_values.data() + m_shader->uniforms()[index].offset;
 }
 
 }  // namespace ITD
@@ -7,6 +7,10 @@ namespace ITD {
 class Material
 {
 private:
+    // Ids are handed out in creation order, 0 is no material
+    inline static uint32_t s_next_id = 1;
+
+    uint32_t m_id;
     const Shader *m_shader;
     std::vector<const Texture *> m_textures;
     std::vector<float> m_values;
@@ -18,19 +22,21 @@ public:
     Material(const Material &other) = delete;
     Material &operator=(const Material &other) = delete;
 
+    uint32_t id() const;
+
     void set_shader(const Shader *shader);
     const Shader *shader() const;
 
-    bool set_texture(const std::string &name, const Texture *texture,
-                     size_t slot = 0);
+    bool set_texture(const std::string &name, const Texture *texture);
     bool set_value(const std::string &name, const float *value);
 
-    const Texture *get_texture(size_t slot) const;
+    // Set by the index of the uniform in the shader, see
+    // Shader::uniform_index
+    void set_texture(int index, const Texture *texture);
+    void set_value(int index, const float *value);
 
-    const std::vector<float> &get_values() const;
-
-private:
-    size_t uniform_length(const Uniform &uniform) const;
+    const Texture *get_texture(int index) const;
+    const float *get_value(int index) const;
 };
 
 }  // namespace ITD
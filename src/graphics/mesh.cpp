@@ -0,0 +1,27 @@
+#include "mesh.h"
+
+namespace ITD {
+
+Mesh::Mesh()
+    : m_vertex_array(0)
+    , m_vertex_buffer(0)
+    , m_index_buffer(0)
+{
+}
+
+Mesh::~Mesh()
+{
+    if (m_vertex_array)
+    {
+        glDeleteBuffers(1, &m_vertex_buffer);
+        glDeleteBuffers(1, &m_index_buffer);
+        glDeleteVertexArrays(1, &m_vertex_array);
+    }
+}
+
+bool Mesh::empty() const
+{
+    return m_submeshes.empty();
+}
+
+}  // namespace ITD
@@ -0,0 +1,37 @@
+#pragma once
+#include <GL/glew.h>
+#include <vector>
+#include "material.h"
+#include "texture.h"
+
+namespace ITD {
+
+// Geometry that is recorded once by the renderer and kept on the GPU, see
+// Renderer::begin_mesh
+class Mesh
+{
+    friend class Renderer;
+
+private:
+    struct Submesh {
+        size_t count;
+        const Texture *texture;
+        Material *material;
+    };
+
+    GLuint m_vertex_array;
+    GLuint m_vertex_buffer;
+    GLuint m_index_buffer;
+    std::vector<Submesh> m_submeshes;
+
+public:
+    Mesh();
+    ~Mesh();
+
+    Mesh(const Mesh &other) = delete;
+    Mesh &operator=(const Mesh &other) = delete;
+
+    bool empty() const;
+};
+
+}  // namespace ITD
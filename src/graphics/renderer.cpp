@@ -1,5 +1,8 @@
 #include "renderer.h"
 #include <math.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include "../debug.h"
 #include "../maths/calc.h"
@@ -10,16 +13,24 @@ namespace {
     const std::string default_vert_str =
         "#version 330\n"
         "uniform mat4 u_matrix;\n"
+        "uniform samplerBuffer u_transforms;\n"
         "layout(location=0) in vec3 a_position;\n"
         "layout(location=1) in vec2 a_uv;\n"
         "layout(location=2) in vec4 a_color;\n"
         "layout(location=3) in vec4 a_mask;\n"
+        "layout(location=4) in uint a_transform;\n"
         "out vec2 v_uv;\n"
         "out vec4 v_col;\n"
         "out vec4 v_mask;\n"
         "void main(void)\n"
         "{\n"
-        "	gl_Position = u_matrix * vec4(a_position.xyz, 1);\n"
+        "	int row = int(a_transform) * 3;\n"
+        "	vec4 pos = vec4(a_position.xyz, 1);\n"
+        "	pos.xyz = vec3(\n"
+        "		dot(texelFetch(u_transforms, row), pos),\n"
+        "		dot(texelFetch(u_transforms, row + 1), pos),\n"
+        "		dot(texelFetch(u_transforms, row + 2), pos));\n"
+        "	gl_Position = u_matrix * pos;\n"
         "	v_uv = a_uv;\n"
         "	v_col = a_color;\n"
         "	v_mask = a_mask;\n"
@@ -40,31 +51,273 @@ namespace {
         "       tcol.a * v_col * v_mask.y + \n"
         "       v_col * v_mask.z;\n"
         "}";
+
+    const std::string instance_vert_str =
+        "#version 330\n"
+        "uniform mat4 u_matrix;\n"
+        "uniform samplerBuffer u_transforms;\n"
+        "layout(location=0) in vec4 a_a;\n"
+        "layout(location=1) in vec4 a_b;\n"
+        "layout(location=2) in float a_param;\n"
+        "layout(location=3) in vec4 a_color;\n"
+        "layout(location=4) in vec4 a_mask;\n"
+        "layout(location=5) in uint a_shape;\n"
+        "layout(location=6) in uint a_transform;\n"
+        "out vec2 v_uv;\n"
+        "out vec4 v_col;\n"
+        "out vec4 v_mask;\n"
+        "out vec2 v_local;\n"
+        "out vec4 v_edges;\n"
+        "flat out vec4 v_data;\n"
+        "flat out float v_param;\n"
+        "flat out uint v_shape;\n"
+        "void main(void)\n"
+        "{\n"
+        "	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+        "	vec2 local = (corner - 0.5) * a_a.zw;\n"
+        "	vec2 point;\n"
+        "	v_local = local;\n"
+        "	v_edges = vec4(0.0);\n"
+        "	v_data = a_b;\n"
+        "	v_param = a_param;\n"
+        "	v_shape = a_shape;\n"
+        "	if (a_shape == 2u)\n"
+        "	{\n"
+        "		point = mix(a_a.xy, a_a.zw, corner.x) + a_b.xy * corner.y;\n"
+        "	}\n"
+        "	else if (a_shape == 3u)\n"
+        "	{\n"
+        "		vec2 dir = normalize(a_a.zw - a_a.xy);\n"
+        "		vec2 norm = vec2(-dir.y, dir.x);\n"
+        "		vec2 end = corner.x < 0.5 ? a_a.xy : a_a.zw;\n"
+        "		vec2 other = corner.x < 0.5 ? a_b.xy : a_b.zw;\n"
+        "		vec2 side = norm;\n"
+        "		if (other != end)\n"
+        "		{\n"
+        "			vec2 other_dir = normalize(corner.x < 0.5 ? end - other\n"
+        "			                                          : other - end);\n"
+        "			vec2 miter = normalize(norm + vec2(-other_dir.y, other_dir.x));\n"
+        "			side = miter / max(dot(miter, norm), 0.25);\n"
+        "		}\n"
+        "		point = end + side * a_param * (corner.y - 0.5);\n"
+        "	}\n"
+        "	else if (a_shape == 4u)\n"
+        "	{\n"
+        "		const int order[4] = int[4](0, 1, 3, 2);\n"
+        "		vec2 p[4] = vec2[4](a_a.xy, a_a.zw, a_b.xy, a_b.zw);\n"
+        "		vec2 center = (p[0] + p[1] + p[2] + p[3]) * 0.25;\n"
+        "		point = p[order[gl_VertexID]];\n"
+        "		for (int i = 0; i < 4; i++)\n"
+        "		{\n"
+        "			vec2 edge = p[(i + 1) % 4] - p[i];\n"
+        "			vec2 n = normalize(vec2(-edge.y, edge.x));\n"
+        "			if (dot(center - p[i], n) < 0.0)\n"
+        "				n = -n;\n"
+        "			v_edges[i] = dot(point - p[i], n);\n"
+        "		}\n"
+        "	}\n"
+        "	else\n"
+        "	{\n"
+        "		float angle = a_shape == 0u ? a_param : 0.0;\n"
+        "		float c = cos(angle);\n"
+        "		float s = sin(angle);\n"
+        "		local = vec2(c * local.x - s * local.y, s * local.x + c * local.y);\n"
+        "		point = a_a.xy + a_a.zw * 0.5 + local;\n"
+        "	}\n"
+        "	vec4 pos = vec4(point, 0, 1);\n"
+        "	int row = int(a_transform) * 3;\n"
+        "	pos.xyz = vec3(\n"
+        "		dot(texelFetch(u_transforms, row), pos),\n"
+        "		dot(texelFetch(u_transforms, row + 1), pos),\n"
+        "		dot(texelFetch(u_transforms, row + 2), pos));\n"
+        "	gl_Position = u_matrix * pos;\n"
+        "	v_uv = mix(a_b.xy, a_b.zw, corner);\n"
+        "	v_col = a_color;\n"
+        "	v_mask = a_mask;\n"
+        "}";
+
+    // Shapes other than sprites are cut out by their distance to the edge
+    const std::string instance_frag_str =
+        "#version 330\n"
+        "uniform sampler2D u_texture;\n"
+        "layout(location=0) out vec4 o_col;\n"
+        "in vec2 v_uv;\n"
+        "in vec4 v_col;\n"
+        "in vec4 v_mask;\n"
+        "in vec2 v_local;\n"
+        "in vec4 v_edges;\n"
+        "flat in vec4 v_data;\n"
+        "flat in float v_param;\n"
+        "flat in uint v_shape;\n"
+        "void main(void)\n"
+        "{\n"
+        "   vec4 tcol = texture(u_texture, v_uv);\n"
+        "   o_col = \n"
+        "       tcol * v_col * v_mask.x + \n"
+        "       tcol.a * v_col * v_mask.y + \n"
+        "       v_col * v_mask.z;\n"
+        "   if (v_shape == 1u)\n"
+        "   {\n"
+        "       float len = length(v_local);\n"
+        "       float dist = v_data.x - len;\n"
+        "       if (v_data.y > 0.0)\n"
+        "           dist = min(dist, len - (v_data.x - v_data.y));\n"
+        "       float aa = max(fwidth(len), 0.0001);\n"
+        "       o_col.a *= clamp(dist / aa + 0.5, 0.0, 1.0);\n"
+        "   }\n"
+        "   else if (v_shape == 4u)\n"
+        "   {\n"
+        "       float dist = min(min(v_edges.x, v_edges.y),\n"
+        "                        min(v_edges.z, v_edges.w));\n"
+        "       float aa = max(fwidth(dist), 0.0001);\n"
+        "       o_col.a *= clamp((v_param - dist) / aa + 0.5, 0.0, 1.0);\n"
+        "   }\n"
+        "}";
 }  // namespace
 
 std::shared_ptr<Shader> Renderer::m_default_shader = nullptr;
+std::shared_ptr<Shader> Renderer::m_instance_shader = nullptr;
 
 Renderer::Renderer()
-    : m_vertex_count(0)
-    , m_vertex_map(nullptr)
-    , m_index_map(nullptr)
+    : Renderer(nullptr)
+{
+}
+
+Renderer::Renderer(Renderer *parent)
+    : m_parent(parent)
+    , m_vertex_array(0)
+    , m_transform_texture(0)
+    , m_instance_array(0)
+    , m_drawing(false)
     , m_matrix(glm::mat4(1.0f))
+    , m_transform_map(nullptr)
+    , m_transform_base(0)
+    , m_transform_count(0)
+    , m_transform(0)
+    , m_transform_dirty(true)
+    , m_cpu_transform(false)
+    , m_recording(nullptr)
+    , m_bound_program(0)
+    , m_bound_vertex_array(0)
+    , m_bound_textures{}
+    , m_bound_material(nullptr)
+    , m_stats{}
+    , m_history{}
+    , m_history_index(0)
+    , m_time_queries{}
+    , m_time_pending{}
+    , m_time_frames{}
+    , m_time_passes{}
+    , m_time_query(0)
+    , m_frame(0)
+    , m_timed_frame(0)
+    , m_gpu_passes(0)
+    , m_gpu_pass_times{}
 {
+    m_command = {
+        .key = 0,
+        .type = BatchType::Triangles,
+        .layer = 0,
+        .depth = 0,
+        .texture = nullptr,
+        .material = nullptr,
+        .mesh = nullptr,
+        .transform = 0,
+        .vertex_start = 0,
+        .vertex_count = 0,
+        .start = 0,
+        .count = 0,
+    };
+
+    if (m_parent)
+        return;
+
+    m_vertex_buffer = std::make_unique<StreamBuffer>(
+        GL_ARRAY_BUFFER, RENDERER_MAX_VERTICES * sizeof(Vertex));
+    m_index_buffer = std::make_unique<StreamBuffer>(
+        GL_ELEMENT_ARRAY_BUFFER, RENDERER_MAX_INDICES * sizeof(Index));
+    m_transform_buffer = std::make_unique<StreamBuffer>(
+        GL_TEXTURE_BUFFER, RENDERER_MAX_TRANSFORMS * sizeof(Transform));
+    m_instance_buffer = std::make_unique<StreamBuffer>(
+        GL_ARRAY_BUFFER, RENDERER_MAX_INSTANCES * sizeof(Instance));
+
     // Create vertex array
     glGenVertexArrays(1, &m_vertex_array);
     glBindVertexArray(m_vertex_array);
 
-    // Create vertex buffer
-    glGenBuffers(1, &m_vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer->id());
+    bind_vertex_layout(true);
+
+    // The index buffer binding is part of the vertex array state
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer->id());
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Instance attributes advance once per instance, the offsets are set
+    // before drawing
+    glGenVertexArrays(1, &m_instance_array);
+    glBindVertexArray(m_instance_array);
+
+    for (GLuint i = 0; i < 7; i++)
+    {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+
+    glBindVertexArray(0);
+
+    glGenQueries(RENDERER_TIME_QUERIES, m_time_queries);
+
+    // Transforms are read from a buffer texture with one row per texel
+    glGenTextures(1, &m_transform_texture);
+    glBindTexture(GL_TEXTURE_BUFFER, m_transform_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_transform_buffer->id());
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+    if (!m_vertex_buffer->persistent())
+    {
+        Log::info("Buffer storage not supported, orphaning stream buffers");
+    }
+
+    if (!m_default_shader)
+    {
+        m_default_shader =
+            std::make_shared<Shader>(default_vert_str, default_frag_str);
+    }
+
+    if (!m_instance_shader)
+    {
+        m_instance_shader =
+            std::make_shared<Shader>(instance_vert_str, instance_frag_str);
+    }
+
+    m_default_material.set_shader(m_default_shader.get());
+    m_instance_material.set_shader(m_instance_shader.get());
+}
+
+Renderer::~Renderer()
+{
+    if (m_parent)
+        return;
+
+    glDeleteQueries(RENDERER_TIME_QUERIES, m_time_queries);
+    glDeleteTextures(1, &m_transform_texture);
+    glDeleteVertexArrays(1, &m_instance_array);
+    glDeleteVertexArrays(1, &m_vertex_array);
+}
 
+void Renderer::bind_vertex_layout(bool transform_attribute)
+{
     // Specify vertex buffer layout
     size_t pos_offset = 3 * sizeof(GLfloat);
     size_t uv_offset = 2 * sizeof(GLfloat);
     size_t color_offset = 4 * sizeof(GLubyte);
     size_t mask_offset = 4 * sizeof(GLubyte);
+    size_t transform_offset = sizeof(GLuint);
 
-    GLsizei stride = pos_offset + uv_offset + color_offset + mask_offset;
+    GLsizei stride = pos_offset + uv_offset + color_offset + mask_offset +
+                     transform_offset;
 
     // Position
     glEnableVertexAttribArray(0);
@@ -86,62 +339,257 @@ Renderer::Renderer()
         3, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride,
         (const GLvoid *)(pos_offset + uv_offset + color_offset));
 
-    // Allocate vertex buffer memory
-    glBufferData(GL_ARRAY_BUFFER, RENDERER_MAX_VERTICES * sizeof(Vertex),
-                 nullptr, GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // Transform index, meshes set it for the whole draw instead
+    if (!transform_attribute)
+        return;
 
-    // Create index buffer
-    glGenBuffers(1, &m_index_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(
+        4, 1, GL_UNSIGNED_INT, stride,
+        (const GLvoid *)(pos_offset + uv_offset + color_offset + mask_offset));
+}
 
-    // Allocate index buffer memory
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 RENDERER_MAX_INDICES * sizeof(GLushort), nullptr,
-                 GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+void Renderer::upload_transform()
+{
+    m_transform_dirty = false;
+    m_cpu_transform = false;
 
-    glBindVertexArray(0);
+    // Meshes are drawn with their own transform, so the matrix is applied
+    // to the geometry while recording
+    if (m_recording)
+    {
+        m_transform = 0;
+        m_cpu_transform = m_matrix != glm::mat4(1.0f);
+        return;
+    }
 
-    if (!m_default_shader)
+    Renderer *root = m_parent ? m_parent : this;
+
+    // The first transform of the frame is the identity
+    if (m_matrix == glm::mat4(1.0f))
     {
-        m_default_shader =
-            std::make_shared<Shader>(default_vert_str, default_frag_str);
+        m_transform = root->m_transform_base;
+        return;
     }
 
-    m_default_material.set_shader(m_default_shader.get());
-    m_batch_front.count = 0;
-    m_batch_front.texture = nullptr;
-    m_batch_front.material = nullptr;
+    // Out of transforms, fall back to transforming on the CPU
+    uint32_t index = root->m_transform_count.fetch_add(1);
+    if (index >= RENDERER_MAX_TRANSFORMS)
+    {
+        m_transform = root->m_transform_base;
+        m_cpu_transform = true;
+        return;
+    }
+
+    Transform *transform = root->m_transform_map + index;
+    for (int i = 0; i < 3; i++)
+    {
+        transform->rows[i] = glm::vec4(m_matrix[0][i], m_matrix[1][i],
+                                       m_matrix[2][i], m_matrix[3][i]);
+    }
+
+    m_transform = root->m_transform_base + index;
 }
 
-Renderer::~Renderer()
+void Renderer::set_command_type(uint8_t type, size_t vertex_count,
+                                size_t count)
 {
-    glDeleteBuffers(1, &m_vertex_buffer);
-    glDeleteBuffers(1, &m_index_buffer);
-    glDeleteVertexArrays(1, &m_vertex_array);
+    size_t max_count = type == BatchType::Instances ? RENDERER_MAX_INSTANCES
+                                                    : RENDERER_MAX_INDICES;
+
+    if (m_command.type != type ||
+        m_command.vertex_count + vertex_count > RENDERER_MAX_VERTICES ||
+        m_command.count + count > max_count)
+    {
+        flush_command();
+    }
+
+    if (m_command.count == 0)
+    {
+        m_command.type = type;
+        m_command.vertex_start = m_vertices.size();
+        m_command.vertex_count = 0;
+        m_command.start = type == BatchType::Instances ? m_instances.size()
+                                                       : m_indices.size();
+    }
+}
+
+void Renderer::flush_command()
+{
+    if (m_command.count == 0)
+        return;
+
+    m_command.key = sort_key(m_command);
+    m_commands.push_back(m_command);
+    m_command.vertex_count = 0;
+    m_command.count = 0;
+}
+
+uint64_t Renderer::sort_key(const Command &command)
+{
+    // Layer and depth decide the draw order, the rest only groups draws
+    // that can share a batch. Draws with the same state keep the order they
+    // were made in, whatever their type. Material ids and texture names
+    // are handed out in creation order, so the order is the same every run
+    uint64_t material = command.material ? command.material->id() & 0xffff : 0;
+    uint64_t texture = command.texture ? command.texture->id() & 0xffff : 0;
+
+    return ((uint64_t)command.layer << 48) | ((uint64_t)command.depth << 32) |
+           (material << 16) | texture;
+}
+
+void Renderer::sort_commands(size_t first)
+{
+    // Stable, so draws with equal keys stay in the order they were made
+    std::stable_sort(m_commands.begin() + first, m_commands.end(),
+                     [](const Command &a, const Command &b)
+                     { return a.key < b.key; });
+}
+
+size_t Renderer::build_batches(size_t first, Vertex *vertices, Index *indices,
+                               Instance *instances, size_t max_vertices,
+                               size_t max_indices, size_t max_instances)
+{
+    size_t batch_start = m_batches.size();
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    size_t instance_count = 0;
+
+    size_t i = first;
+    for (; i < m_commands.size(); i++)
+    {
+        const Command &command = m_commands[i];
+
+        bool full =
+            command.type == BatchType::Instances
+                ? instance_count + command.count > max_instances
+                : vertex_count + command.vertex_count > max_vertices ||
+                      index_count + command.count > max_indices;
+
+        if (full)
+            break;
+
+        Batch *last =
+            m_batches.size() > batch_start ? &m_batches.back() : nullptr;
+
+        if (!last || command.type == BatchType::Mesh ||
+            last->type != command.type || last->texture != command.texture ||
+            last->material != command.material)
+        {
+            m_batches.push_back({
+                .type = command.type,
+                .offset = command.type == BatchType::Instances
+                              ? instance_count
+                              : index_count,
+                .count = 0,
+                .texture = command.texture,
+                .material = command.material,
+                .mesh = command.mesh,
+                .transform = command.transform,
+            });
+        }
+
+        Batch &batch = m_batches.back();
+
+        if (command.type == BatchType::Instances)
+        {
+            memcpy(instances + instance_count,
+                   m_instances.data() + command.start,
+                   command.count * sizeof(Instance));
+            instance_count += command.count;
+        }
+        else if (command.type == BatchType::Triangles)
+        {
+            memcpy(vertices + vertex_count,
+                   m_vertices.data() + command.vertex_start,
+                   command.vertex_count * sizeof(Vertex));
+
+            for (size_t j = 0; j < command.count; j++)
+            {
+                indices[index_count + j] =
+                    m_indices[command.start + j] + vertex_count;
+            }
+
+            vertex_count += command.vertex_count;
+            index_count += command.count;
+        }
+
+        batch.count += command.count;
+    }
+
+    return i;
+}
+
+bool Renderer::use_instances()
+{
+    if (m_command.material || m_recording)
+        return false;
+
+    if (m_transform_dirty)
+    {
+        upload_transform();
+    }
+
+    return !m_cpu_transform;
+}
+
+void Renderer::push_instance(const glm::vec4 &a, const glm::vec4 &b,
+                             float param, Color color, uint8_t mult,
+                             uint8_t wash, uint8_t fill, uint8_t shape)
+{
+    set_command_type(BatchType::Instances, 0, 1);
+
+    m_instances.push_back({
+        .a = a,
+        .b = b,
+        .param = param,
+        .color = color,
+        .mult = mult,
+        .wash = wash,
+        .fill = fill,
+        .shape = shape,
+        .transform = m_transform,
+    });
+
+    m_command.count++;
 }
 
 void Renderer::make_vertex(float px, float py, float pz, float tx, float ty,
                            Color color, uint8_t mult, uint8_t wash,
                            uint8_t fill)
 {
-    m_vertex_map->pos.x = m_matrix[0][0] * px + m_matrix[1][0] * py +
-                          m_matrix[2][0] * pz + m_matrix[3][0];
+    if (m_transform_dirty)
+    {
+        upload_transform();
+    }
 
-    m_vertex_map->pos.y = m_matrix[0][1] * px + m_matrix[1][1] * py +
-                          m_matrix[2][1] * pz + m_matrix[3][1];
+    Vertex &vertex = m_vertices.emplace_back();
 
-    m_vertex_map->pos.z = m_matrix[0][2] * px + m_matrix[1][2] * py +
-                          m_matrix[2][2] * pz + m_matrix[3][2];
+    if (m_cpu_transform)
+    {
+        vertex.pos.x = m_matrix[0][0] * px + m_matrix[1][0] * py +
+                       m_matrix[2][0] * pz + m_matrix[3][0];
+
+        vertex.pos.y = m_matrix[0][1] * px + m_matrix[1][1] * py +
+                       m_matrix[2][1] * pz + m_matrix[3][1];
+
+        vertex.pos.z = m_matrix[0][2] * px + m_matrix[1][2] * py +
+                       m_matrix[2][2] * pz + m_matrix[3][2];
+    }
+    else
+    {
+        vertex.pos.x = px;
+        vertex.pos.y = py;
+        vertex.pos.z = pz;
+    }
 
-    m_vertex_map->uv.x = tx;
-    m_vertex_map->uv.y = ty;
-    m_vertex_map->color = color;
-    m_vertex_map->mult = mult;
-    m_vertex_map->wash = wash;
-    m_vertex_map->fill = fill;
-    m_vertex_map++;
+    vertex.uv.x = tx;
+    vertex.uv.y = ty;
+    vertex.color = color;
+    vertex.mult = mult;
+    vertex.wash = wash;
+    vertex.fill = fill;
+    vertex.transform = m_transform;
 }
 
 void Renderer::push_triangle(float px0, float py0, float pz0, float px1,
@@ -151,19 +599,19 @@ void Renderer::push_triangle(float px0, float py0, float pz0, float px1,
                              Color c1, Color c2, uint8_t mult, uint8_t wash,
                              uint8_t fill)
 {
+    set_command_type(BatchType::Triangles, 3, 3);
+
     make_vertex(px0, py0, pz0, tx0, ty0, c0, mult, wash, fill);
     make_vertex(px1, py1, pz1, tx1, ty1, c1, mult, wash, fill);
     make_vertex(px2, py2, pz2, tx2, ty2, c2, mult, wash, fill);
 
-    *m_index_map = m_vertex_count;
-    m_index_map++;
-    *m_index_map = m_vertex_count + 1;
-    m_index_map++;
-    *m_index_map = m_vertex_count + 2;
-    m_index_map++;
+    Index first = m_command.vertex_count;
+    m_indices.push_back(first);
+    m_indices.push_back(first + 1);
+    m_indices.push_back(first + 2);
 
-    m_batch_front.count += 3;
-    m_vertex_count += 3;
+    m_command.count += 3;
+    m_command.vertex_count += 3;
 }
 
 void Renderer::push_quad(float px0, float py0, float pz0, float px1, float py1,
@@ -173,51 +621,66 @@ void Renderer::push_quad(float px0, float py0, float pz0, float px1, float py1,
                          Color c0, Color c1, Color c2, Color c3, uint8_t mult,
                          uint8_t wash, uint8_t fill)
 {
+    set_command_type(BatchType::Triangles, 4, 6);
+
     make_vertex(px0, py0, pz0, tx0, ty0, c0, mult, wash, fill);
     make_vertex(px1, py1, pz1, tx1, ty1, c1, mult, wash, fill);
     make_vertex(px2, py2, pz2, tx2, ty2, c2, mult, wash, fill);
     make_vertex(px3, py3, pz3, tx3, ty3, c3, mult, wash, fill);
 
-    *m_index_map = m_vertex_count;
-    m_index_map++;
-    *m_index_map = m_vertex_count + 1;
-    m_index_map++;
-    *m_index_map = m_vertex_count + 2;
-    m_index_map++;
+    Index first = m_command.vertex_count;
+    m_indices.push_back(first);
+    m_indices.push_back(first + 1);
+    m_indices.push_back(first + 2);
 
-    *m_index_map = m_vertex_count + 2;
-    m_index_map++;
-    *m_index_map = m_vertex_count + 3;
-    m_index_map++;
-    *m_index_map = m_vertex_count;
-    m_index_map++;
+    m_indices.push_back(first + 2);
+    m_indices.push_back(first + 3);
+    m_indices.push_back(first);
 
-    m_batch_front.count += 6;
-    m_vertex_count += 4;
+    m_command.count += 6;
+    m_command.vertex_count += 4;
 }
 
 void Renderer::set_texture(const Texture *texture)
 {
-    if (m_batch_front.count > 0 && m_batch_front.texture != texture)
+    if (m_command.texture != texture)
+    {
+        flush_command();
+    }
+
+    m_command.texture = texture;
+}
+
+void Renderer::set_layer(uint16_t layer)
+{
+    if (m_command.layer != layer)
     {
-        m_batches.push_back(m_batch_front);
-        m_batch_front.count = 0;
+        flush_command();
     }
 
-    m_batch_front.texture = texture;
+    m_command.layer = layer;
+}
+
+void Renderer::set_depth(uint16_t depth)
+{
+    if (m_command.depth != depth)
+    {
+        flush_command();
+    }
+
+    m_command.depth = depth;
 }
 
 void Renderer::push_material(Material *material)
 {
-    m_material_stack.push_back(m_batch_front.material);
+    m_material_stack.push_back(m_command.material);
 
-    if (m_batch_front.count > 0 && m_batch_front.material != material)
+    if (m_command.material != material)
     {
-        m_batches.push_back(m_batch_front);
-        m_batch_front.count = 0;
+        flush_command();
     }
 
-    m_batch_front.material = material;
+    m_command.material = material;
 }
 
 Material *Renderer::pop_material()
@@ -225,16 +688,16 @@ Material *Renderer::pop_material()
     ITD_ASSERT(m_material_stack.size() > 0,
                "Can't pop from empty material stack");
 
-    Material *was = m_batch_front.material;
+    Material *was = m_command.material;
     Material *material = m_material_stack.back();
+    m_material_stack.pop_back();
 
-    if (m_batch_front.count > 0 && m_batch_front.material != material)
+    if (m_command.material != material)
     {
-        m_batches.push_back(m_batch_front);
-        m_batch_front.count = 0;
+        flush_command();
     }
 
-    m_batch_front.material = material;
+    m_command.material = material;
 
     return was;
 }
@@ -251,6 +714,8 @@ void Renderer::push_matrix(const glm::mat4 &matrix, bool absolute)
     {
         m_matrix = m_matrix * matrix;
     }
+
+    m_transform_dirty = true;
 }
 
 glm::mat4 Renderer::pop_matrix()
@@ -260,6 +725,7 @@ glm::mat4 Renderer::pop_matrix()
     glm::mat4 was = m_matrix;
     m_matrix = m_matrix_stack.back();
     m_matrix_stack.pop_back();
+    m_transform_dirty = true;
 
     return was;
 }
@@ -271,21 +737,201 @@ glm::mat4 Renderer::peek_matrix()
 
 void Renderer::begin()
 {
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
-    m_vertex_map = (Vertex *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+    m_drawing = true;
+    m_vertices.clear();
+    m_indices.clear();
+    m_instances.clear();
+    m_commands.clear();
+    m_batches.clear();
+    m_command.layer = 0;
+    m_command.depth = 0;
+    m_command.count = 0;
+
+    m_transform_map = (Transform *)m_transform_buffer->map();
+    m_transform_base = m_transform_buffer->offset() / sizeof(Transform);
+    m_transform_map[0] = {glm::vec4(1.0f, 0.0f, 0.0f, 0.0f),
+                          glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+                          glm::vec4(0.0f, 0.0f, 1.0f, 0.0f)};
+    m_transform_count = 1;
+    m_transform_dirty = true;
+}
+
+Renderer *Renderer::recorder(size_t index)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+    ITD_ASSERT(!m_parent && !m_recording,
+               "Recorders can only be made by the main renderer");
+
+    while (m_recorders.size() <= index)
+    {
+        m_recorders.push_back(std::unique_ptr<Renderer>(new Renderer(this)));
+    }
+
+    Renderer *recorder = m_recorders[index].get();
+    recorder->m_drawing = true;
+    recorder->m_vertices.clear();
+    recorder->m_indices.clear();
+    recorder->m_instances.clear();
+    recorder->m_commands.clear();
+
+    recorder->m_command = m_command;
+    recorder->m_command.vertex_count = 0;
+    recorder->m_command.count = 0;
+    recorder->m_matrix = m_matrix;
+    recorder->m_matrix_stack.clear();
+    recorder->m_material_stack.clear();
+    recorder->m_transform_dirty = true;
+
+    return recorder;
+}
+
+void Renderer::merge_recorders(size_t count)
+{
+    ITD_ASSERT(count <= m_recorders.size(), "Recorder does not exist");
+
+    flush_command();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        Renderer *recorder = m_recorders[i].get();
+        recorder->flush_command();
+        recorder->m_drawing = false;
+
+        // Starts are moved past what is already recorded here
+        size_t vertex_offset = m_vertices.size();
+        size_t index_offset = m_indices.size();
+        size_t instance_offset = m_instances.size();
+
+        m_vertices.insert(m_vertices.end(), recorder->m_vertices.begin(),
+                          recorder->m_vertices.end());
+        m_indices.insert(m_indices.end(), recorder->m_indices.begin(),
+                         recorder->m_indices.end());
+        m_instances.insert(m_instances.end(), recorder->m_instances.begin(),
+                           recorder->m_instances.end());
+
+        for (Command command : recorder->m_commands)
+        {
+            command.vertex_start += vertex_offset;
+            command.start += command.type == BatchType::Instances
+                                 ? instance_offset
+                                 : index_offset;
+            m_commands.push_back(command);
+        }
+    }
+}
+
+void Renderer::begin_mesh(Mesh *mesh)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+    ITD_ASSERT(!m_parent, "Recorders can't record meshes");
+    ITD_ASSERT(!m_recording, "Already recording a mesh");
+
+    // The mesh is recorded after the frame's commands, and removed from
+    // them again when it ends
+    flush_command();
+
+    m_recording = mesh;
+    m_frame_command_count = m_commands.size();
+    m_frame_vertex_count = m_vertices.size();
+    m_frame_index_count = m_indices.size();
+    m_frame_command = m_command;
+    m_transform_dirty = true;
+}
+
+void Renderer::end_mesh()
+{
+    ITD_ASSERT(m_recording, "No mesh is being recorded");
+
+    flush_command();
+
+    Mesh *mesh = m_recording;
+    size_t vertex_count = m_vertices.size() - m_frame_vertex_count;
+    size_t index_count = m_indices.size() - m_frame_index_count;
+
+    ITD_ASSERT(vertex_count <= (size_t)std::numeric_limits<Index>::max() + 1,
+               "Mesh has too many vertices");
+
+    m_mesh_vertices.resize(vertex_count);
+    m_mesh_indices.resize(index_count);
+    sort_commands(m_frame_command_count);
+    build_batches(m_frame_command_count, m_mesh_vertices.data(),
+                  m_mesh_indices.data(), nullptr, vertex_count, index_count,
+                  0);
+
+    mesh->m_submeshes.clear();
+    for (const auto &batch : m_batches)
+    {
+        mesh->m_submeshes.push_back({
+            .count = batch.count,
+            .texture = batch.texture,
+            .material = batch.material,
+        });
+    }
+
+    if (!mesh->m_vertex_array)
+    {
+        glGenVertexArrays(1, &mesh->m_vertex_array);
+        glGenBuffers(1, &mesh->m_vertex_buffer);
+        glGenBuffers(1, &mesh->m_index_buffer);
+
+        glBindVertexArray(mesh->m_vertex_array);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->m_vertex_buffer);
+        bind_vertex_layout(false);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->m_index_buffer);
+        glBindVertexArray(0);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->m_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(Vertex),
+                 m_mesh_vertices.data(), GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
-    m_index_map =
-        (GLushort *)glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindVertexArray(mesh->m_vertex_array);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_count * sizeof(Index),
+                 m_mesh_indices.data(), GL_STATIC_DRAW);
+    glBindVertexArray(0);
+
+    // Back to the frame
+    m_recording = nullptr;
+    m_batches.clear();
+    m_commands.resize(m_frame_command_count);
+    m_vertices.resize(m_frame_vertex_count);
+    m_indices.resize(m_frame_index_count);
+    m_command = m_frame_command;
+    m_transform_dirty = true;
+}
+
+void Renderer::mesh(const Mesh *mesh)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+    ITD_ASSERT(!m_recording, "Can't draw a mesh while recording one");
+
+    if (mesh->empty())
+        return;
+
+    if (m_transform_dirty)
+    {
+        upload_transform();
+    }
+
+    flush_command();
+
+    Command command = m_command;
+    command.type = BatchType::Mesh;
+    command.texture = nullptr;
+    command.material = nullptr;
+    command.mesh = mesh;
+    command.transform = m_transform;
+    command.vertex_count = 0;
+    command.count = 0;
+    command.key = sort_key(command);
+    m_commands.push_back(command);
 }
 
 void Renderer::tri(const glm::vec2 &pos0, const glm::vec2 &pos1,
                    const glm::vec2 &pos2, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     push_triangle(pos0.x, pos0.y, 0.0f, pos1.x, pos1.y, 0.0f, pos2.x, pos2.y,
                   0.0f, 0, 0, 0, 0, 0, 0, color, color, color, 0, 0, 255);
@@ -294,8 +940,7 @@ void Renderer::tri(const glm::vec2 &pos0, const glm::vec2 &pos1,
 void Renderer::tri(const glm::vec3 &pos0, const glm::vec3 &pos1,
                    const glm::vec3 &pos2, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     push_triangle(pos0.x, pos0.y, pos0.z, pos1.x, pos1.y, pos1.z, pos2.x,
                   pos2.y, pos2.z, 0, 0, 0, 0, 0, 0, color, color, color, 0, 0,
@@ -309,8 +954,15 @@ void Renderer::rect(const Rectf &r, Color color)
 
 void Renderer::rect(const glm::vec2 &bl, const glm::vec2 &tr, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    if (use_instances())
+    {
+        push_instance(glm::vec4(bl.x, bl.y, tr.x - bl.x, tr.y - bl.y),
+                      glm::vec4(), 0.0f, color, 0, 0, 255,
+                      InstanceShape::Sprite);
+        return;
+    }
 
     push_quad(bl.x, bl.y, 0.0f, bl.x, tr.y, 0.0f, tr.x, tr.y, 0.0f, tr.x, bl.y,
               0.0f, 0, 0, 0, 0, 0, 0, 0, 0, color, color, color, color, 0, 0,
@@ -319,6 +971,12 @@ void Renderer::rect(const glm::vec2 &bl, const glm::vec2 &tr, Color color)
 
 void Renderer::rect_line(const Rectf &r, float t, Color color)
 {
+    if (use_instances())
+    {
+        quad_line(Quadf(r, 0.0f), t, color);
+        return;
+    }
+
     // Bottom
     rect(r.bl, glm::vec2(r.tr.x, r.bl.y + t), color);
 
@@ -340,8 +998,7 @@ void Renderer::quad(const Quadf &q, Color color)
 void Renderer::quad(const glm::vec2 &a, const glm::vec2 &b, const glm::vec2 &c,
                     const glm::vec2 &d, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     push_quad(a.x, a.y, 0.0f, b.x, b.y, 0.0f, c.x, c.y, 0.0f, d.x, d.y, 0.0f, 0,
               0, 0, 0, 0, 0, 0, 0, color, color, color, color, 0, 0, 255);
@@ -350,8 +1007,7 @@ void Renderer::quad(const glm::vec2 &a, const glm::vec2 &b, const glm::vec2 &c,
 void Renderer::quad(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c,
                     const glm::vec3 &d, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     push_quad(a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z, d.x, d.y, d.z, 0, 0,
               0, 0, 0, 0, 0, 0, color, color, color, color, 0, 0, 255);
@@ -359,6 +1015,16 @@ void Renderer::quad(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c,
 
 void Renderer::quad_line(const Quadf &q, float t, Color color)
 {
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    if (use_instances())
+    {
+        push_instance(glm::vec4(q.a.x, q.a.y, q.b.x, q.b.y),
+                      glm::vec4(q.c.x, q.c.y, q.d.x, q.d.y), t, color, 0, 0,
+                      255, InstanceShape::QuadLine);
+        return;
+    }
+
     glm::vec2 center = q.center();
 
     for (int i = 0; i < 4; i++)
@@ -383,12 +1049,57 @@ void Renderer::line(const glm::vec2 &start, const glm::vec2 &end, float t,
 void Renderer::line(const glm::vec2 &start, const glm::vec2 &end, float t,
                     const glm::vec2 &t_dir, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    if (use_instances())
+    {
+        push_instance(glm::vec4(start.x, start.y, end.x, end.y),
+                      glm::vec4(t * t_dir.x, t * t_dir.y, 0.0f, 0.0f), 0.0f,
+                      color, 0, 0, 255, InstanceShape::Line);
+        return;
+    }
 
     quad(start, start + t * t_dir, end + t * t_dir, end, color);
 }
 
+void Renderer::polyline(const glm::vec2 *points, size_t count, float t,
+                        Color color, bool closed)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    if (count < 2)
+        return;
+
+    bool instances = use_instances();
+    size_t segments = closed ? count : count - 1;
+
+    for (size_t i = 0; i < segments; i++)
+    {
+        const glm::vec2 &p0 = points[i];
+        const glm::vec2 &p1 = points[(i + 1) % count];
+
+        if (!instances)
+        {
+            glm::vec2 dir = Calc::normalize(p1 - p0);
+            glm::vec2 norm = glm::vec2(-dir.y, dir.x);
+            line(p0 - norm * (t * 0.5f), p1 - norm * (t * 0.5f), t, norm,
+                 color);
+            continue;
+        }
+
+        // Open ends repeat their own point, which the shader reads as no
+        // join
+        bool first = i == 0 && !closed;
+        bool last = i == segments - 1 && !closed;
+        const glm::vec2 &prev = first ? p0 : points[(i + count - 1) % count];
+        const glm::vec2 &next = last ? p1 : points[(i + 2) % count];
+
+        push_instance(glm::vec4(p0.x, p0.y, p1.x, p1.y),
+                      glm::vec4(prev.x, prev.y, next.x, next.y), t, color, 0,
+                      0, 255, InstanceShape::Polyline);
+    }
+}
+
 void Renderer::circ(const glm::vec2 &center, float radius, unsigned int steps,
                     Color color)
 {
@@ -409,16 +1120,61 @@ void Renderer::circ(const glm::vec2 &center, float radius, unsigned int steps,
     }
 }
 
+void Renderer::circ(const glm::vec2 &center, float radius, Color color,
+                    float thickness)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    if (use_instances())
+    {
+        // One unit of margin for the anti-aliased edge
+        float extent = radius + 1.0f;
+        push_instance(glm::vec4(center.x - extent, center.y - extent,
+                                extent * 2.0f, extent * 2.0f),
+                      glm::vec4(radius, thickness, 0.0f, 0.0f), 0.0f, color,
+                      0, 0, 255, InstanceShape::Circle);
+        return;
+    }
+
+    // Without instances the circle is built from segments
+    const unsigned int steps = 16;
+
+    if (thickness <= 0.0f)
+    {
+        circ(center, radius, steps, color);
+        return;
+    }
+
+    float step_rad = Calc::TAU / (float)steps;
+    float inner = radius - thickness;
+
+    for (size_t i = 0; i < steps; i++)
+    {
+        glm::vec2 dir0(cosf(i * step_rad), sinf(i * step_rad));
+        glm::vec2 dir1(cosf((i + 1) * step_rad), sinf((i + 1) * step_rad));
+
+        quad(center + dir0 * inner, center + dir0 * radius,
+             center + dir1 * radius, center + dir1 * inner, color);
+    }
+}
+
 void Renderer::tex(const Texture *texture, const glm::vec2 &pos, Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     set_texture(texture);
 
     float mx = pos.x + texture->width() - 1.0f;
     float my = pos.y + texture->height() - 1.0f;
 
+    if (use_instances())
+    {
+        push_instance(glm::vec4(pos.x, pos.y, mx - pos.x, my - pos.y),
+                      glm::vec4(0.0f, 1.0f, 1.0f, 0.0f), 0.0f, color, 255, 0,
+                      0, InstanceShape::Sprite);
+        return;
+    }
+
     push_quad(pos.x, pos.y, 0.0f, pos.x, my, 0.0f, mx, my, 0.0f, mx, pos.y,
               0.0f, 0, 1, 0, 0, 1, 0, 1, 1, color, color, color, color, 255, 0,
               0);
@@ -427,8 +1183,7 @@ void Renderer::tex(const Texture *texture, const glm::vec2 &pos, Color color)
 void Renderer::tex(const Subtexture &subtexture, const glm::vec2 &pos,
                    Color color)
 {
-    ITD_ASSERT(m_vertex_map && m_index_map,
-               "Render phase has not been started");
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
 
     // TODO: Check if texture is set?
     set_texture(subtexture.get_texture());
@@ -441,125 +1196,478 @@ void Renderer::tex(const Subtexture &subtexture, const glm::vec2 &pos,
 
     const std::array<glm::vec2, 4> &coords = subtexture.get_tex_coords();
 
+    if (use_instances())
+    {
+        push_instance(glm::vec4(pos.x, pos.y, mx - pos.x, my - pos.y),
+                      glm::vec4(coords[0].x, 1.0f - coords[0].y, coords[2].x,
+                                1.0f - coords[2].y),
+                      0.0f, color, 255, 0, 0, InstanceShape::Sprite);
+        return;
+    }
+
     push_quad(pos.x, pos.y, 0.0f, pos.x, my, 0.0, mx, my, 0.0f, mx, pos.y, 0.0f,
               coords[0].x, 1.0f - coords[0].y, coords[1].x, 1.0f - coords[1].y,
               coords[2].x, 1.0f - coords[2].y, coords[3].x, 1.0f - coords[3].y,
               color, color, color, color, 255, 0, 0);
 }
 
+void Renderer::tex(const Subtexture &subtexture, const Rectf &rect,
+                   Color color)
+{
+    ITD_ASSERT(m_drawing, "Render phase has not been started");
+
+    set_texture(subtexture.get_texture());
+
+    const glm::vec2 &bl = rect.bl;
+    const glm::vec2 &tr = rect.tr;
+    const std::array<glm::vec2, 4> &coords = subtexture.get_tex_coords();
+
+    if (use_instances())
+    {
+        push_instance(glm::vec4(bl.x, bl.y, tr.x - bl.x, tr.y - bl.y),
+                      glm::vec4(coords[0].x, 1.0f - coords[0].y, coords[2].x,
+                                1.0f - coords[2].y),
+                      0.0f, color, 255, 0, 0, InstanceShape::Sprite);
+        return;
+    }
+
+    push_quad(bl.x, bl.y, 0.0f, bl.x, tr.y, 0.0f, tr.x, tr.y, 0.0f, tr.x, bl.y,
+              0.0f, coords[0].x, 1.0f - coords[0].y, coords[1].x,
+              1.0f - coords[1].y, coords[2].x, 1.0f - coords[2].y, coords[3].x,
+              1.0f - coords[3].y, color, color, color, color, 255, 0, 0);
+}
+
 void Renderer::end()
 {
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
-    glUnmapBuffer(GL_ARRAY_BUFFER);
-    m_vertex_map = nullptr;
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    flush_command();
+    sort_commands(0);
+
+    m_transform_buffer->unmap();
+    m_transform_map = nullptr;
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
-    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
-    m_index_map = nullptr;
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    m_drawing = false;
 }
 
-void Renderer::render(const glm::mat4 &matrix)
+void Renderer::bind_instances(size_t offset)
 {
-    ITD_ASSERT(!m_vertex_map && !m_index_map,
-               "Render phase has not been ended");
+    GLsizei stride = sizeof(Instance);
+    const unsigned char *base = (const unsigned char *)offset;
+
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride,
+                          base + offsetof(Instance, a));
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride,
+                          base + offsetof(Instance, b));
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride,
+                          base + offsetof(Instance, param));
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          base + offsetof(Instance, color));
+    glVertexAttribPointer(4, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          base + offsetof(Instance, mult));
+    glVertexAttribIPointer(5, 1, GL_UNSIGNED_BYTE, stride,
+                           base + offsetof(Instance, shape));
+    glVertexAttribIPointer(6, 1, GL_UNSIGNED_INT, stride,
+                           base + offsetof(Instance, transform));
+}
 
-    // Nothing to draw
-    if (m_batches.size() == 0 && m_batch_front.count == 0)
+void Renderer::bind_vertex_array(GLuint vertex_array)
+{
+    if (m_bound_vertex_array == vertex_array)
         return;
 
-    glBindVertexArray(m_vertex_array);
+    glBindVertexArray(vertex_array);
+    m_bound_vertex_array = vertex_array;
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+void Renderer::bind_texture(size_t slot, const Texture *texture)
+{
+    ITD_ASSERT(slot < RENDERER_MAX_TEXTURE_SLOTS, "Too many texture slots");
 
-    // Add current batch to list
-    m_batches.push_back(m_batch_front);
+    GLuint id = texture ? texture->id() : 0;
+    if (m_bound_textures[slot] == id)
+        return;
 
-    glUseProgram(m_default_shader->id());
+    glActiveTexture(GL_TEXTURE0 + slot);
+    glBindTexture(GL_TEXTURE_2D, id);
+    m_bound_textures[slot] = id;
+    m_stats.texture_switches++;
+}
+
+void Renderer::apply_material(const Material *material, const Texture *texture,
+                              const glm::mat4 &matrix)
+{
+    const Shader *shader = material->shader();
+    ITD_ASSERT(shader, "Material must have shader");
 
-    // Render batches
-    size_t offset = 0;
-    for (auto &batch : m_batches)
+    auto it = m_shader_states.find(shader);
+    if (it == m_shader_states.end())
     {
-        if (!batch.material)
-        {
-            batch.material = &m_default_material;
-        }
+        ShaderState state = {
+            .matrix = shader->uniform_index("u_matrix"),
+            .texture = shader->uniform_index("u_texture"),
+            .uploaded = false,
+            .values = std::vector<float>(shader->value_count()),
+        };
+
+        it = m_shader_states.emplace(shader, std::move(state)).first;
+    }
 
-        const Shader *shader = batch.material->shader();
-        ITD_ASSERT(shader, "Material must have shader");
+    ShaderState &state = it->second;
 
+    if (m_bound_material != material)
+    {
+        m_bound_material = material;
+        m_stats.material_switches++;
+    }
+
+    if (m_bound_program != shader->id())
+    {
         glUseProgram(shader->id());
+        m_bound_program = shader->id();
+    }
 
-        // Set universal uniforms
-        batch.material->set_texture("u_texture", batch.texture);
-        batch.material->set_value("u_matrix", &matrix[0][0]);
+    const std::vector<Uniform> &uniforms = shader->uniforms();
+    for (size_t i = 0; i < uniforms.size(); i++)
+    {
+        const Uniform &uniform = uniforms[i];
 
-        // Upload uniform values
-        GLint texture_slot = 0;
+        // Sampler units never change, so they are only set once
+        if (uniform.type == GL_SAMPLER_BUFFER)
+        {
+            if (!state.uploaded)
+            {
+                glUniform1i(uniform.location, RENDERER_TRANSFORM_TEXTURE_UNIT);
+            }
 
-        auto val_iter = batch.material->get_values().begin();
+            continue;
+        }
 
-        for (const auto &uniform : shader->uniforms())
+        if (uniform.type == GL_SAMPLER_2D)
         {
-            const GLint location = shader->uniform_location(uniform.name);
+            bind_texture(uniform.offset, (int)i == state.texture
+                                             ? texture
+                                             : material->get_texture(i));
 
-            if (uniform.type == GL_SAMPLER_2D)
+            if (!state.uploaded)
             {
-                const Texture *tex = batch.material->get_texture(texture_slot);
+                glUniform1i(uniform.location, uniform.offset);
+            }
 
-                glActiveTexture(GL_TEXTURE0 + texture_slot);
+            continue;
+        }
 
-                // TODO: No need to check if a texture is valid if they are kept active
-                // for the whole game
-                if (tex && glIsTexture(tex->id()))
-                {
-                    glBindTexture(GL_TEXTURE_2D, tex->id());
-                }
-                else
-                {
-                    glBindTexture(GL_TEXTURE_2D, 0);
-                }
+        const float *value =
+            (int)i == state.matrix ? &matrix[0][0] : material->get_value(i);
+        float *uploaded = state.values.data() + uniform.offset;
+        size_t size = uniform.length * sizeof(float);
 
-                glUniform1i(location, texture_slot);
-                texture_slot++;
+        if (state.uploaded && memcmp(uploaded, value, size) == 0)
+            continue;
 
-                continue;
-            }
+        memcpy(uploaded, value, size);
+        m_stats.bytes_uploaded += size;
 
-            switch (uniform.type)
+        switch (uniform.type)
+        {
+            case GL_FLOAT:
+                glUniform1f(uniform.location, *value);
+                break;
+            case GL_FLOAT_VEC2:
+                glUniform2fv(uniform.location, 1, value);
+                break;
+            case GL_FLOAT_MAT4:
+                glUniformMatrix4fv(uniform.location, 1, GL_FALSE, value);
+                break;
+        };
+    }
+
+    state.uploaded = true;
+}
+
+void Renderer::render(const glm::mat4 &matrix)
+{
+    ITD_ASSERT(!m_drawing, "Render phase has not been ended");
+
+    m_frame++;
+    read_time_queries();
+
+    m_stats = {};
+    m_stats.gpu_passes = m_gpu_passes;
+    for (uint32_t i = 0; i < m_gpu_passes; i++)
+    {
+        m_stats.gpu_pass_times[i] = m_gpu_pass_times[i];
+        m_stats.gpu_time += m_gpu_pass_times[i];
+    }
+    m_stats.commands = m_commands.size();
+    m_stats.transforms =
+        std::min<uint32_t>(m_transform_count, RENDERER_MAX_TRANSFORMS);
+    m_stats.bytes_uploaded = m_stats.transforms * sizeof(Transform);
+
+    // Nothing to draw
+    if (m_commands.size() == 0)
+        return;
+
+    // Textures can be bound by others between frames
+    for (auto &id : m_bound_textures)
+    {
+        id = (GLuint)-1;
+    }
+
+    m_bound_material = nullptr;
+
+    glActiveTexture(GL_TEXTURE0 + RENDERER_TRANSFORM_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, m_transform_texture);
+
+    // Fill a segment of each stream buffer and draw it, until all commands
+    // are drawn. Segments are only reused once the GPU is done with them
+    size_t next = 0;
+    bool timing = false;
+    while (next < m_commands.size())
+    {
+        size_t first = next;
+        uint32_t pass = m_stats.passes;
+
+        if (pass < RENDERER_MAX_TIMED_PASSES)
+        {
+            timing = begin_time_query(pass);
+        }
+
+        // Without buffer storage, mapping binds the index buffer to the
+        // element target and would replace the bound vertex array's one
+        glBindVertexArray(0);
+        m_bound_vertex_array = 0;
+
+        Vertex *vertices = (Vertex *)m_vertex_buffer->map();
+        Index *indices = (Index *)m_index_buffer->map();
+        Instance *instances = (Instance *)m_instance_buffer->map();
+
+        next = build_batches(next, vertices, indices, instances,
+                             RENDERER_MAX_VERTICES, RENDERER_MAX_INDICES,
+                             RENDERER_MAX_INSTANCES);
+
+        ITD_ASSERT(next > first, "Command does not fit in a segment");
+
+        for (size_t i = first; i < next; i++)
+        {
+            const Command &command = m_commands[i];
+            if (command.type == BatchType::Instances)
             {
-                case GL_FLOAT:
-                    glUniform1f(location, *val_iter);
-                    val_iter++;
-                    break;
-                case GL_FLOAT_VEC2:
-                    glUniform2fv(location, 2, &(*val_iter));
-                    val_iter += 2;
-                    break;
-                case GL_FLOAT_MAT4:
-                    glUniformMatrix4fv(location, 1, GL_FALSE, &(*val_iter));
-                    val_iter += 16;
-                    break;
-            };
+                m_stats.instances += command.count;
+            }
+            else if (command.type == BatchType::Triangles)
+            {
+                m_stats.vertices += command.vertex_count;
+                m_stats.indices += command.count;
+            }
         }
 
-        glDrawElements(GL_TRIANGLES, batch.count, GL_UNSIGNED_SHORT,
-                       (void *)(offset * sizeof(GLushort)));
+        m_stats.passes++;
 
-        offset += batch.count;
+        m_vertex_buffer->unmap();
+        m_index_buffer->unmap();
+        m_instance_buffer->unmap();
+
+        draw_batches(matrix);
+
+        // The last timed query runs on until the frame is done
+        if (timing && (pass + 1 < RENDERER_MAX_TIMED_PASSES ||
+                       next >= m_commands.size()))
+        {
+            end_time_query();
+            timing = false;
+        }
     }
 
+    m_transform_buffer->fence();
+
+    m_stats.bytes_uploaded += m_stats.vertices * sizeof(Vertex) +
+                              m_stats.indices * sizeof(Index) +
+                              m_stats.instances * sizeof(Instance);
+
+    m_history[m_history_index] = m_stats;
+    m_history_index = (m_history_index + 1) % RENDERER_STATS_HISTORY;
+
     glUseProgram(0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+    m_bound_program = 0;
+    m_bound_vertex_array = 0;
+
+    m_commands.clear();
+}
+
+void Renderer::draw_batches(const glm::mat4 &matrix)
+{
+    // The indices are relative to the start of the vertex segment
+    GLint base_vertex = m_vertex_buffer->offset() / sizeof(Vertex);
+    size_t index_offset = m_index_buffer->offset();
+    size_t instance_offset = m_instance_buffer->offset();
+
+    // Instance attributes are pointed into the instance buffer per batch
+    glBindBuffer(GL_ARRAY_BUFFER, m_instance_buffer->id());
+
+    m_stats.batches += m_batches.size();
+
+    for (const auto &batch : m_batches)
+    {
+        if (batch.type == BatchType::Mesh)
+        {
+            const Mesh *mesh = batch.mesh;
+            size_t mesh_offset = 0;
+
+            bind_vertex_array(mesh->m_vertex_array);
+            glVertexAttribI1ui(4, batch.transform);
+
+            for (const auto &submesh : mesh->m_submeshes)
+            {
+                const Material *material = submesh.material
+                                               ? submesh.material
+                                               : &m_default_material;
+                apply_material(material, submesh.texture, matrix);
+
+                glDrawElements(GL_TRIANGLES, submesh.count, index_type,
+                               (void *)(mesh_offset * sizeof(Index)));
+                m_stats.draw_calls++;
+
+                mesh_offset += submesh.count;
+            }
+
+            continue;
+        }
+
+        if (batch.type == BatchType::Instances)
+        {
+            apply_material(&m_instance_material, batch.texture, matrix);
+
+            bind_vertex_array(m_instance_array);
+            bind_instances(instance_offset + batch.offset * sizeof(Instance));
+
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch.count);
+            m_stats.draw_calls++;
+            continue;
+        }
+
+        const Material *material =
+            batch.material ? batch.material : &m_default_material;
+        apply_material(material, batch.texture, matrix);
+
+        bind_vertex_array(m_vertex_array);
+
+        glDrawElementsBaseVertex(
+            GL_TRIANGLES, batch.count, index_type,
+            (void *)(index_offset + batch.offset * sizeof(Index)),
+            base_vertex);
+        m_stats.draw_calls++;
+    }
+
+    m_vertex_buffer->fence();
+    m_index_buffer->fence();
+    m_instance_buffer->fence();
 
-    m_vertex_count = 0;
-    m_batch_front.count = 0;
     m_batches.clear();
 }
 
+bool Renderer::begin_time_query(uint32_t pass)
+{
+    // Not timed if the query is still waiting for its result
+    size_t query = m_time_query;
+    if (m_time_pending[query])
+        return false;
+
+    glBeginQuery(GL_TIME_ELAPSED, m_time_queries[query]);
+    m_time_frames[query] = m_frame;
+    m_time_passes[query] = pass;
+
+    return true;
+}
+
+void Renderer::end_time_query()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    m_time_pending[m_time_query] = true;
+    m_time_query = (m_time_query + 1) % RENDERER_TIME_QUERIES;
+}
+
+void Renderer::read_time_queries()
+{
+    for (size_t i = 0; i < RENDERER_TIME_QUERIES; i++)
+    {
+        if (!m_time_pending[i])
+            continue;
+
+        GLint available = 0;
+        glGetQueryObjectiv(m_time_queries[i], GL_QUERY_RESULT_AVAILABLE,
+                           &available);
+        if (!available)
+            continue;
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(m_time_queries[i], GL_QUERY_RESULT, &elapsed);
+        m_time_pending[i] = false;
+
+        uint64_t frame = m_time_frames[i];
+        uint32_t pass = m_time_passes[i];
+
+        if (frame < m_timed_frame)
+            continue;
+
+        if (frame > m_timed_frame)
+        {
+            m_timed_frame = frame;
+            m_gpu_passes = 0;
+            for (auto &time : m_gpu_pass_times)
+            {
+                time = 0.0f;
+            }
+        }
+
+        m_gpu_pass_times[pass] = elapsed / 1000000.0f;
+        m_gpu_passes = std::max(m_gpu_passes, pass + 1);
+    }
+}
+
+const RendererStats &Renderer::stats() const
+{
+    return m_stats;
+}
+
+void Renderer::render_stats(const Rectf &bounds)
+{
+    float width = (bounds.tr.x - bounds.bl.x) / RENDERER_STATS_HISTORY;
+    float half = (bounds.tr.y - bounds.bl.y) * 0.5f;
+
+    rect(bounds, Color(0, 0, 0, 128));
+
+    // Oldest frame on the left
+    for (size_t i = 0; i < RENDERER_STATS_HISTORY; i++)
+    {
+        const RendererStats &frame =
+            m_history[(m_history_index + i) % RENDERER_STATS_HISTORY];
+        float x = bounds.bl.x + i * width;
+
+        // Passes are stacked in alternating colors, or all red when the
+        // frame is over budget
+        float y = bounds.bl.y;
+        for (uint32_t pass = 0; pass < frame.gpu_passes; pass++)
+        {
+            float gpu = frame.gpu_pass_times[pass] / stats_frame_budget;
+            float top = std::min(y + gpu * half, bounds.bl.y + half);
+
+            Color gpu_color = frame.gpu_time > stats_frame_budget ? Color::red
+                              : pass % 2 == 0                     ? Color::green
+                                                                  : Color::blue;
+            rect(glm::vec2(x, y), glm::vec2(x + width, top), gpu_color);
+            y = top;
+        }
+
+        float calls =
+            std::min(frame.draw_calls / (float)stats_max_draw_calls, 1.0f);
+        Color calls_color = frame.draw_calls > stats_max_draw_calls
+                                ? Color::red
+                                : Color::yellow;
+        rect(glm::vec2(x, bounds.bl.y + half),
+             glm::vec2(x + width, bounds.bl.y + half + calls * half),
+             calls_color);
+    }
+}
+
 }  // namespace ITD
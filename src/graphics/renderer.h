@@ -1,23 +1,72 @@
 #pragma once
 #include <GL/glew.h>
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 #include <vector>
 #include "color.h"
 #include "material.h"
+#include "mesh.h"
 #include "shader.h"
+#include "streambuffer.h"
 #include "subtexture.h"
 #include "texture.h"
 
 namespace ITD {
 
+// Size of one stream buffer segment. A frame that doesn't fit is drawn in
+// several segments
+#ifndef RENDERER_MAX_SPRITES
 #define RENDERER_MAX_SPRITES 10000
+#endif
 #define RENDERER_MAX_VERTICES RENDERER_MAX_SPRITES * 4
 #define RENDERER_MAX_INDICES RENDERER_MAX_SPRITES * 6
+#define RENDERER_MAX_INSTANCES 65536
+#define RENDERER_MAX_TRANSFORMS 4096
+#define RENDERER_TRANSFORM_TEXTURE_UNIT 15
+#define RENDERER_MAX_TEXTURE_SLOTS 8
+#define RENDERER_MAX_TIMED_PASSES 4
+#define RENDERER_TIME_QUERIES (4 * RENDERER_MAX_TIMED_PASSES)
+#define RENDERER_STATS_HISTORY 120
+
+#ifndef RENDERER_INDEX_32
+static_assert(RENDERER_MAX_VERTICES <= 65536,
+              "Segments with more vertices need RENDERER_INDEX_32");
+#endif
+
+// Counters of the last rendered frame. GPU times are in milliseconds, per
+// segment pass and in total, and read back a few frames late to avoid
+// waiting for the GPU. The last timed pass includes the passes after it
+struct RendererStats {
+    uint32_t commands;
+    uint32_t passes;
+    uint32_t batches;
+    uint32_t draw_calls;
+    uint32_t vertices;
+    uint32_t indices;
+    uint32_t instances;
+    uint32_t transforms;
+    uint32_t texture_switches;
+    uint32_t material_switches;
+    size_t bytes_uploaded;
+    uint32_t gpu_passes;
+    float gpu_pass_times[RENDERER_MAX_TIMED_PASSES];
+    float gpu_time;
+};
 
 class Renderer
 {
 private:
+    // Define RENDERER_INDEX_32 to allow more than 65536 vertices in a
+    // segment or mesh
+#ifdef RENDERER_INDEX_32
+    using Index = GLuint;
+    static constexpr GLenum index_type = GL_UNSIGNED_INT;
+#else
+    using Index = GLushort;
+    static constexpr GLenum index_type = GL_UNSIGNED_SHORT;
+#endif
+
     struct Vertex {
         glm::vec3 pos;
         glm::vec2 uv;
@@ -26,31 +75,166 @@ private:
         uint8_t wash;
         uint8_t fill;
         uint8_t padd;
+        uint32_t transform;
+    };
+
+    // Rows of an affine transform, fetched by index in the vertex shader
+    struct Transform {
+        glm::vec4 rows[3];
+    };
+
+    // Compact record expanded into a quad in the vertex shader
+    struct Instance {
+        // Sprite: position and size, the uv rect from the bottom left to
+        // the top right corner, and the rotation around the center.
+        // Circle: position and size of the bounds with room for the
+        // anti-aliased edge, and the radius and ring thickness.
+        // Line: start and end, and the offset of the far side.
+        // Polyline segment: start and end, the points before and after
+        // them, or the same points at open ends, and the thickness.
+        // Quad outline: the four corners in order, and the thickness
+        glm::vec4 a;
+        glm::vec4 b;
+        float param;
+        Color color;
+        uint8_t mult;
+        uint8_t wash;
+        uint8_t fill;
+        uint8_t shape;
+        uint32_t transform;
+    };
+
+    struct InstanceShape {
+        static constexpr uint8_t Sprite = 0;
+        static constexpr uint8_t Circle = 1;
+        static constexpr uint8_t Line = 2;
+        static constexpr uint8_t Polyline = 3;
+        static constexpr uint8_t QuadLine = 4;
+    };
+
+    struct BatchType {
+        static constexpr uint8_t Triangles = 0;
+        static constexpr uint8_t Instances = 1;
+        static constexpr uint8_t Mesh = 2;
+    };
+
+    // Run of primitives recorded with the same state. Indices are relative
+    // to the first vertex of the run, so runs can be reordered freely
+    struct Command {
+        uint64_t key;
+        uint8_t type;
+        uint16_t layer;
+        uint16_t depth;
+        const Texture *texture;
+        Material *material;
+        const Mesh *mesh;
+        uint32_t transform;
+        size_t vertex_start;
+        size_t vertex_count;
+        size_t start;
+        size_t count;
     };
 
     struct Batch {
+        uint8_t type;
+        size_t offset;
         size_t count;
         const Texture *texture;
         Material *material;
+        const Mesh *mesh;
+        uint32_t transform;
     };
 
+    // Renderer that recorders add their draws to, recorders own no GL
+    // objects
+    Renderer *m_parent;
+    std::vector<std::unique_ptr<Renderer>> m_recorders;
+
     GLuint m_vertex_array;
-    GLuint m_vertex_buffer;
-    GLuint m_index_buffer;
+    std::unique_ptr<StreamBuffer> m_vertex_buffer;
+    std::unique_ptr<StreamBuffer> m_index_buffer;
+    std::unique_ptr<StreamBuffer> m_transform_buffer;
+    GLuint m_transform_texture;
+
+    GLuint m_instance_array;
+    std::unique_ptr<StreamBuffer> m_instance_buffer;
 
-    size_t m_vertex_count;
-    Vertex *m_vertex_map;
-    GLushort *m_index_map;
+    // Primitives are recorded on the CPU, and copied into the stream
+    // buffers in sort key order at the end of the frame
+    bool m_drawing;
+    std::vector<Vertex> m_vertices;
+    std::vector<Index> m_indices;
+    std::vector<Instance> m_instances;
+    std::vector<Command> m_commands;
+    Command m_command;
     std::vector<Batch> m_batches;
-    Batch m_batch_front;
 
     glm::mat4 m_matrix;
     std::vector<glm::mat4> m_matrix_stack;
 
+    // Vertices are stored untransformed with the index of the current
+    // matrix, which is uploaded the first time a vertex uses it. Recorders
+    // upload into the transforms of their parent
+    Transform *m_transform_map;
+    uint32_t m_transform_base;
+    std::atomic<uint32_t> m_transform_count;
+    uint32_t m_transform;
+    bool m_transform_dirty;
+    bool m_cpu_transform;
+
+    // Mesh being recorded, and the frame state to return to
+    Mesh *m_recording;
+    std::vector<Vertex> m_mesh_vertices;
+    std::vector<Index> m_mesh_indices;
+    size_t m_frame_command_count;
+    size_t m_frame_vertex_count;
+    size_t m_frame_index_count;
+    Command m_frame_command;
+
     std::vector<Material *> m_material_stack;
 
+    // Uniforms the renderer sets itself, and the values last uploaded to
+    // the shader's program
+    struct ShaderState {
+        int matrix;
+        int texture;
+        bool uploaded;
+        std::vector<float> values;
+    };
+
+    // GL state set while rendering, so unchanged state isn't set again
+    std::unordered_map<const Shader *, ShaderState> m_shader_states;
+    GLuint m_bound_program;
+    GLuint m_bound_vertex_array;
+    GLuint m_bound_textures[RENDERER_MAX_TEXTURE_SLOTS];
+    const Material *m_bound_material;
+
+    // Scale of the stats overlay
+    static constexpr float stats_frame_budget = 1000.0f / 60.0f;
+    static constexpr uint32_t stats_max_draw_calls = 64;
+
+    RendererStats m_stats;
+    RendererStats m_history[RENDERER_STATS_HISTORY];
+    size_t m_history_index;
+
+    // Ring of queries with one query per pass, a query is only reused once
+    // its result is read. Results can become available out of order, so
+    // the frame and pass each query timed are kept, and only results of
+    // the newest timed frame are shown
+    GLuint m_time_queries[RENDERER_TIME_QUERIES];
+    bool m_time_pending[RENDERER_TIME_QUERIES];
+    uint64_t m_time_frames[RENDERER_TIME_QUERIES];
+    uint32_t m_time_passes[RENDERER_TIME_QUERIES];
+    size_t m_time_query;
+    uint64_t m_frame;
+    uint64_t m_timed_frame;
+    uint32_t m_gpu_passes;
+    float m_gpu_pass_times[RENDERER_MAX_TIMED_PASSES];
+
     static std::shared_ptr<Shader> m_default_shader;
+    static std::shared_ptr<Shader> m_instance_shader;
     Material m_default_material;
+    Material m_instance_material;
 
 public:
     Renderer();
@@ -61,6 +245,12 @@ public:
 
     void set_texture(const Texture *texture);
 
+    // Everything is drawn in order of layer and then depth. Within the
+    // same layer and depth, draws are grouped by material and texture, so
+    // their order is only kept between draws that share both
+    void set_layer(uint16_t layer);
+    void set_depth(uint16_t depth);
+
     void push_material(Material *material);
     Material *pop_material();
 
@@ -72,6 +262,26 @@ public:
     void render(const glm::mat4 &matrix);
     void end();
 
+    const RendererStats &stats() const;
+
+    // Graph of the last frames inside bounds, GPU time of each pass against
+    // a 60 fps budget on the bottom half and draw calls on the top half
+    void render_stats(const Rectf &bounds);
+
+    // Renderer for drawing from another thread, starting from the current
+    // layer, depth, material and matrix. Only drawing functions can be
+    // used on it. merge_recorders adds what the first count recorders drew
+    // in order of index, as if it was drawn here
+    Renderer *recorder(size_t index);
+    void merge_recorders(size_t count);
+
+    // Everything drawn between begin_mesh and end_mesh is stored in mesh
+    // instead of the frame, and can then be drawn with a single call every
+    // frame. Only allowed during the render phase
+    void begin_mesh(Mesh *mesh);
+    void end_mesh();
+    void mesh(const Mesh *mesh);
+
     void tri(const glm::vec2 &pos0, const glm::vec2 &pos1,
              const glm::vec2 &pos2, Color color);
     void tri(const glm::vec3 &pos0, const glm::vec3 &pos1,
@@ -94,13 +304,64 @@ public:
     void line(const glm::vec2 &start, const glm::vec2 &end, float t,
               const glm::vec2 &t_dir, Color color);
 
+    // Line through the points, t thick and centered on them, with mitered
+    // joins between segments
+    void polyline(const glm::vec2 *points, size_t count, float t, Color color,
+                  bool closed = false);
+
     void circ(const glm::vec2 &center, float radius, unsigned int steps,
               Color color);
 
+    // Drawn as one quad with an anti-aliased edge. A thickness above 0
+    // draws a ring of that width instead of a disc
+    void circ(const glm::vec2 &center, float radius, Color color,
+              float thickness = 0.0f);
+
     void tex(const Texture *texture, const glm::vec2 &pos, Color color);
     void tex(const Subtexture &subtexture, const glm::vec2 &pos, Color color);
 
+    // Stretches the subtexture over rect
+    void tex(const Subtexture &subtexture, const Rectf &rect, Color color);
+
 private:
+    Renderer(Renderer *parent);
+
+    // Sets up the attributes for the vertex buffer bound to GL_ARRAY_BUFFER
+    void bind_vertex_layout(bool transform_attribute);
+    void upload_transform();
+
+    // Starts a new command if the state changed, or if a primitive of
+    // vertex_count vertices and count indices or instances would make the
+    // command too large for a stream buffer segment
+    void set_command_type(uint8_t type, size_t vertex_count, size_t count);
+    void flush_command();
+    static uint64_t sort_key(const Command &command);
+
+    void sort_commands(size_t first);
+
+    // Copies the commands from first onwards into batches until one doesn't
+    // fit, and returns the index of that command. Commands next to each
+    // other with the same state share a batch
+    size_t build_batches(size_t first, Vertex *vertices, Index *indices,
+                         Instance *instances, size_t max_vertices,
+                         size_t max_indices, size_t max_instances);
+    void draw_batches(const glm::mat4 &matrix);
+    bool begin_time_query(uint32_t pass);
+    void end_time_query();
+    void read_time_queries();
+
+    // Instances can only be used with the default material
+    bool use_instances();
+    void push_instance(const glm::vec4 &a, const glm::vec4 &b, float param,
+                       Color color, uint8_t mult, uint8_t wash, uint8_t fill,
+                       uint8_t shape);
+
+    void bind_instances(size_t offset);
+    void bind_vertex_array(GLuint vertex_array);
+    void bind_texture(size_t slot, const Texture *texture);
+    void apply_material(const Material *material, const Texture *texture,
+                        const glm::mat4 &matrix);
+
     void make_vertex(float px, float py, float pz, float tx, float ty,
                      Color color, uint8_t mult, uint8_t wash, uint8_t fill);
 
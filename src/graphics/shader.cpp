@@ -3,8 +3,27 @@
 
 namespace ITD {
 
+namespace {
+    size_t uniform_length(GLenum type)
+    {
+        switch (type)
+        {
+            case GL_FLOAT:
+                return 1;
+            case GL_FLOAT_VEC2:
+                return 2;
+            case GL_FLOAT_MAT4:
+                return 16;
+        };
+
+        return 0;
+    }
+}  // namespace
+
 Shader::Shader(const std::string &vert_str, const std::string &frag_str)
     : m_id(0)
+    , m_texture_count(0)
+    , m_value_count(0)
 {
     GLuint vert = glCreateShader(GL_VERTEX_SHADER);
     GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
@@ -72,12 +91,27 @@ Shader::Shader(const std::string &vert_str, const std::string &frag_str)
                            name);
         name[length] = '\0';
 
-        m_uniforms.push_back({
+        Uniform uniform = {
             .name = std::string(name),
             .type = type,
-        });
-
-        m_locations[m_uniforms.back().name] = glGetUniformLocation(m_id, name);
+            .location = glGetUniformLocation(m_id, name),
+            .offset = 0,
+            .length = uniform_length(type),
+        };
+
+        if (type == GL_SAMPLER_2D)
+        {
+            uniform.offset = m_texture_count;
+            m_texture_count++;
+        }
+        else
+        {
+            uniform.offset = m_value_count;
+            m_value_count += uniform.length;
+        }
+
+        m_indices[uniform.name] = m_uniforms.size();
+        m_uniforms.push_back(uniform);
     }
 }
 
@@ -99,9 +133,20 @@ const std::vector<Uniform> &Shader::uniforms() const
     return m_uniforms;
 }
 
-GLint Shader::uniform_location(const std::string &name) const
+int Shader::uniform_index(const std::string &name) const
+{
+    auto it = m_indices.find(name);
+    return it != m_indices.end() ? it->second : -1;
+}
+
+size_t Shader::texture_count() const
+{
+    return m_texture_count;
+}
+
+size_t Shader::value_count() const
 {
-    return m_locations.at(name);
+    return m_value_count;
 }
 
 }  // namespace ITD
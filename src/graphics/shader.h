@@ -10,6 +10,11 @@ namespace ITD {
 struct Uniform {
     std::string name;
     GLenum type;
+    GLint location;
+    // Texture slot for samplers, otherwise the offset of the value in a
+    // material's values, which is length floats long
+    size_t offset;
+    size_t length;
 };
 
 class Shader
@@ -17,7 +22,9 @@ class Shader
 private:
     GLuint m_id;
     std::vector<Uniform> m_uniforms;
-    std::unordered_map<std::string, GLint> m_locations;
+    std::unordered_map<std::string, int> m_indices;
+    size_t m_texture_count;
+    size_t m_value_count;
 
 public:
     Shader(const std::string &vert_str, const std::string &frag_str);
@@ -29,7 +36,12 @@ public:
     GLuint id() const;
 
     const std::vector<Uniform> &uniforms() const;
-    GLint uniform_location(const std::string &name) const;
+
+    // Index in uniforms, or -1 if there is no uniform called name
+    int uniform_index(const std::string &name) const;
+
+    size_t texture_count() const;
+    size_t value_count() const;
 };
 
 }  // namespace ITD
@@ -0,0 +1,135 @@
+#include "streambuffer.h"
+#include "../debug.h"
+
+namespace ITD {
+
+StreamBuffer::StreamBuffer(GLenum target, size_t segment_size)
+    : m_target(target)
+    , m_segment_size(segment_size)
+    , m_segment(0)
+    , m_persistent(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+    , m_persistent_map(nullptr)
+    , m_fences{}
+{
+    glGenBuffers(1, &m_id);
+    glBindBuffer(m_target, m_id);
+
+    if (m_persistent)
+    {
+        GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        glBufferStorage(m_target, segments * m_segment_size, nullptr, flags);
+        m_persistent_map = (unsigned char *)glMapBufferRange(
+            m_target, 0, segments * m_segment_size, flags);
+
+        ITD_ASSERT(m_persistent_map, "Failed to map stream buffer");
+    }
+    else
+    {
+        glBufferData(m_target, m_segment_size, nullptr, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(m_target, 0);
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    for (auto fence : m_fences)
+    {
+        if (fence)
+        {
+            glDeleteSync(fence);
+        }
+    }
+
+    if (m_persistent)
+    {
+        glBindBuffer(m_target, m_id);
+        glUnmapBuffer(m_target);
+        glBindBuffer(m_target, 0);
+    }
+
+    glDeleteBuffers(1, &m_id);
+}
+
+void *StreamBuffer::map()
+{
+    if (m_persistent)
+    {
+        m_segment = (m_segment + 1) % segments;
+
+        // Only waits if the GPU is more than segments - 1 frames behind
+        GLsync &fence = m_fences[m_segment];
+        if (fence)
+        {
+            GLenum result = GL_TIMEOUT_EXPIRED;
+            while (result == GL_TIMEOUT_EXPIRED)
+            {
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                          1000000);
+            }
+
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+
+        return m_persistent_map + offset();
+    }
+
+    // Invalidating the whole buffer gives it new storage, so the driver
+    // doesn't have to wait for draws still using the old one
+    glBindBuffer(m_target, m_id);
+    void *map = glMapBufferRange(m_target, 0, m_segment_size,
+                                 GL_MAP_WRITE_BIT |
+                                     GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(m_target, 0);
+
+    return map;
+}
+
+void StreamBuffer::unmap()
+{
+    if (m_persistent)
+        return;
+
+    glBindBuffer(m_target, m_id);
+    glUnmapBuffer(m_target);
+    glBindBuffer(m_target, 0);
+}
+
+void StreamBuffer::fence()
+{
+    if (!m_persistent)
+        return;
+
+    GLsync &fence = m_fences[m_segment];
+    if (fence)
+    {
+        glDeleteSync(fence);
+    }
+
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLuint StreamBuffer::id() const
+{
+    return m_id;
+}
+
+bool StreamBuffer::persistent() const
+{
+    return m_persistent;
+}
+
+size_t StreamBuffer::offset() const
+{
+    return m_segment * m_segment_size;
+}
+
+size_t StreamBuffer::segment_size() const
+{
+    return m_segment_size;
+}
+
+}  // namespace ITD
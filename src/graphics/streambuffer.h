@@ -0,0 +1,47 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+
+namespace ITD {
+
+// Buffer that is written by the CPU every frame. With buffer storage support
+// the buffer is split into a ring of segments that stay mapped, and a fence
+// keeps a segment from being written while the GPU is still reading it.
+// Otherwise the buffer storage is orphaned every time it is mapped
+class StreamBuffer
+{
+public:
+    static constexpr size_t segments = 3;
+
+private:
+    GLenum m_target;
+    GLuint m_id;
+    size_t m_segment_size;
+    size_t m_segment;
+    bool m_persistent;
+    unsigned char *m_persistent_map;
+    GLsync m_fences[segments];
+
+public:
+    StreamBuffer(GLenum target, size_t segment_size);
+    ~StreamBuffer();
+
+    StreamBuffer(const StreamBuffer &other) = delete;
+    StreamBuffer &operator=(const StreamBuffer &other) = delete;
+
+    // Moves to the next segment and returns a pointer to its memory
+    void *map();
+    void unmap();
+
+    // Marks the current segment as in use by the draw calls issued so far
+    void fence();
+
+    GLuint id() const;
+    bool persistent() const;
+
+    // Byte offset of the current segment in the buffer
+    size_t offset() const;
+    size_t segment_size() const;
+};
+
+}  // namespace ITD
@@ -49,6 +49,19 @@ void Texture::load(const Image &image)
     load(image.width(), image.height(), (unsigned char *)image.pixels());
 }
 
+void Texture::update(size_t x, size_t y, size_t width, size_t height,
+                     const unsigned char *data)
+{
+    ITD_ASSERT(m_id != 0, "Texture has not been loaded");
+    ITD_ASSERT(x + width <= (size_t)m_width && y + height <= (size_t)m_height,
+               "Update is outside of the texture");
+
+    glBindTexture(GL_TEXTURE_2D, m_id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA,
+                    GL_UNSIGNED_BYTE, data);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 Texture::~Texture()
 {
     glDeleteTextures(1, &m_id);
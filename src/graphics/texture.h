@@ -23,6 +23,10 @@ public:
               const unsigned char *data);
     void load(const Image &image);
 
+    // Replaces the region starting x pixels in and y rows down
+    void update(size_t x, size_t y, size_t width, size_t height,
+                const unsigned char *data);
+
     GLuint id() const;
     size_t width() const;
     size_t height() const;
@@ -10,6 +10,7 @@
 #include "gameplay/mover.h"
 #include "gameplay/player.h"
 #include "gameplay/playerhud.h"
+#include "gameplay/renderbounds.h"
 #include "gameplay/tilemap.h"
 #include "gameplay/torpedo.h"
 #include "gameplay/wall.h"
@@ -40,7 +41,8 @@ int main()
                                          Property::Renderable);
     Scene::register_component<Animator>(Property::Updatable |
                                         Property::Renderable);
-    Scene::register_component<Wall>(Property::Renderable);
+    Scene::register_component<Wall>(Property::Static);
+    Scene::register_component<RenderBounds>();
 
     Platform::init();
     Renderer renderer;
@@ -56,6 +56,12 @@ struct Rect {
                tr.y >= point.y;
     }
 
+    bool overlaps(const Rect &other) const
+    {
+        return bl.x <= other.tr.x && tr.x >= other.bl.x && bl.y <= other.tr.y &&
+               tr.y >= other.bl.y;
+    }
+
     T width() const
     {
         return tr.x - bl.x + 1;
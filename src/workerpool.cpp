@@ -0,0 +1,96 @@
+#include "workerpool.h"
+
+namespace ITD {
+
+WorkerPool::WorkerPool(size_t threads)
+    : m_count(0)
+    , m_next(0)
+    , m_unfinished(0)
+    , m_quit(false)
+{
+    for (size_t i = 0; i < threads; i++)
+    {
+        m_threads.emplace_back(&WorkerPool::work, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+
+    m_start.notify_all();
+
+    for (auto &thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+size_t WorkerPool::size() const
+{
+    return m_threads.size() + 1;
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)> &fn)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_job = fn;
+    m_count = count;
+    m_next = 0;
+    m_unfinished = count;
+
+    lock.unlock();
+    m_start.notify_all();
+    lock.lock();
+
+    // Help out instead of waiting
+    while (run_next(lock))
+    {
+    }
+
+    m_done.wait(lock, [this]() { return m_unfinished == 0; });
+
+    m_job = nullptr;
+    m_count = 0;
+    m_next = 0;
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        m_start.wait(lock, [this]() { return m_quit || m_next < m_count; });
+
+        if (m_quit)
+            return;
+
+        run_next(lock);
+    }
+}
+
+bool WorkerPool::run_next(std::unique_lock<std::mutex> &lock)
+{
+    if (m_next >= m_count)
+        return false;
+
+    size_t index = m_next++;
+
+    // The job isn't replaced until every call to it has returned
+    lock.unlock();
+    m_job(index);
+    lock.lock();
+
+    if (--m_unfinished == 0)
+    {
+        m_done.notify_one();
+    }
+
+    return true;
+}
+
+}  // namespace ITD
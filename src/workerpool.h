@@ -0,0 +1,47 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ITD {
+
+// Threads that are started once and sleep until work is handed to them.
+// run calls fn(i) for every i below count, spread over the workers and the
+// calling thread, and returns when all calls are done
+class WorkerPool
+{
+private:
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+
+    std::function<void(size_t)> m_job;
+    size_t m_count;
+    size_t m_next;
+    size_t m_unfinished;
+    bool m_quit;
+
+public:
+    WorkerPool(size_t threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &other) = delete;
+    WorkerPool &operator=(const WorkerPool &other) = delete;
+
+    // Number of jobs that can run at the same time, including the caller
+    size_t size() const;
+
+    void run(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+    void work();
+
+    // Runs the next job if there is one, with the lock held on entry
+    bool run_next(std::unique_lock<std::mutex> &lock);
+};
+
+}  // namespace ITD